@@ -51,6 +51,7 @@
 #define TS_CLOCK       27000000LL
 #define TS_START       10
 #define TIMESTAMP_CLOCK 90000LL
+#define TIMESTAMP_MOD   (1LL << 33) /* PTS, DTS and PCR base wrap around at 33 bits */
 
 // arbitrary
 #define MAX_PROGRAMS   100
@@ -60,6 +61,11 @@
 #define PCR_MAX_RETRANS_TIME 40
 #define PAT_MAX_RETRANS_TIME 100
 
+/* ISO 13818-1 system_clock_frequency tolerance and maximum rate of change */
+#define PCR_MAX_FREQ_OFFSET 810   /* Hz */
+#define PCR_MAX_SLEW_RATE   0.075 /* Hz/s */
+#define CLOCK_LOCK_TIME     60    /* seconds over which a clock error is taken up */
+
 /* PIDs */
 #define PAT_PID         0x0000
 #define NIT_PID         0x0010
@@ -93,6 +99,7 @@
 
 #define TB_SIZE       4096
 #define RX_SYS        1000000
+#define SYS_BS        1536*8
 #define R_SYS_DEFAULT 80000
 
 /* Macros */
@@ -158,6 +165,13 @@ typedef struct
     buffer_queue_t queued_packets[10];
 } buffer_t;
 
+/* access unit awaiting removal from the T-STD */
+typedef struct
+{
+    int64_t dts;
+    int size; /* in bits */
+} tstd_au_t;
+
 typedef struct
 {
     int pid;
@@ -194,6 +208,28 @@ typedef struct
     buffer_t eb; /* elementary buffer */
     int rbx;     /* flow from multiplex to elementary buffer (video) */
 
+    int num_tstd_aus;
+    int tstd_aus_alloced;
+    tstd_au_t *tstd_aus;
+    int mb_discard; /* bits still to leave the transport buffer which never enter the multiplex buffer */
+
+    /* rate cap */
+    int max_bitrate;
+    buffer_t rate_b; /* leaky bucket draining at max_bitrate */
+
+    /* splicing */
+    int splice_pending;     /* splice point not yet reached */
+    int64_t splice_pts;
+    int splice_seamless;
+    int splice_type;
+    int splice_ltw;
+    int splice_piecewise_rate;
+    int splice_point_flag;  /* the next packet carries splice_countdown */
+    int splice_countdown;
+    int64_t splice_dts_next_au;
+
+    int64_t reorder_dts; /* DTS of the last frame released by the reorder stage */
+
     /* Language Codes */
     int write_lang_code;
     char lang_code[4];
@@ -232,8 +268,10 @@ typedef struct
 {
     uint8_t *data;
     int size;
+    int data_alloced;
     uint8_t *cur_pos;
     int bytes_left;
+    int complete; /* all chunks of the frame have been received */
 
     /* stream context associated with pes */
     ts_int_stream_t *stream;
@@ -241,6 +279,7 @@ typedef struct
     int header_size;
     int random_access;
     int priority;
+    int fcc_psi_sent; /* PAT and PMT have been queued in front of this random access point */
 
     int64_t initial_arrival_time;
     int64_t final_arrival_time;
@@ -252,6 +291,11 @@ typedef struct
     int ref_pic_idc;
     int write_pulldown_info;
     int pic_struct;
+
+    /* frame completion callback */
+    void *opaque;
+    int64_t input_time; /* wall clock, in microseconds */
+    int64_t first_pcr;
 } ts_int_pes_t;
 
 typedef struct
@@ -259,9 +303,6 @@ typedef struct
     ts_int_stream_t pmt;
     int program_num;
 
-    int num_queued_pmt;
-    uint8_t **pmt_packets;
-
     int num_streams;
     ts_int_stream_t *streams[MAX_STREAMS];
     ts_int_stream_t *pcr_stream;
@@ -279,6 +320,60 @@ typedef struct
     int sb_size;
 } ts_int_program_t;
 
+enum carousel_table_e
+{
+    CAROUSEL_PAT,
+    CAROUSEL_PMT,
+    CAROUSEL_SDT,
+    CAROUSEL_NIT,
+    CAROUSEL_TDT,
+    CAROUSEL_SECTIONS, /* supplied by the application */
+};
+
+/* table retransmitted periodically, scheduled by earliest deadline */
+typedef struct
+{
+    int id;
+    int table;
+    int program;      /* index of the program for the PMT */
+    int pid;
+    int cc;           /* application supplied sections only */
+    int period;       /* in milliseconds, built-in tables use the writer's period */
+    int max_bitrate;  /* bitrate budget in bits/s, 0 for none */
+    int num_packets;  /* packets sent last time */
+    int64_t next_send;
+    int64_t queued_until; /* num_sent of its queue once the copy sent last time has been written */
+
+    int num_sections;
+    uint8_t **sections;
+    int *section_lengths;
+} ts_int_carousel_t;
+
+/* low priority packets written instead of null packets in CBR mode */
+typedef struct
+{
+    int pid;
+    int cc;
+    int max_bitrate; /* in bits/s, 0 for none */
+    int64_t next_send;
+
+    int read_pos;
+    int num_packets;
+    int packets_alloced;
+    uint8_t *packets;
+} ts_int_fill_source_t;
+
+/* PSI/SI packets waiting to be written */
+typedef struct
+{
+    int read_pos;
+    int num_packets;
+    int packets_alloced;
+    int tail_used;    /* bytes before the stuffing in the last queued packet */
+    uint8_t *packets;
+    int64_t num_sent; /* packets written since the writer was set up */
+} ts_int_psi_queue_t;
+
 struct ts_writer_t
 {
     struct
@@ -291,13 +386,42 @@ struct ts_writer_t
     uint64_t bytes_written;
     uint64_t packets_written;
     uint64_t pcr_start;
+    int64_t last_input_dts; /* latest unwrapped input DTS, INT64_MIN if none */
+    int64_t pcr_clock;      /* PCR ticks per second, slewed from TS_CLOCK to follow the clock reference */
+
+    /* clock reference */
+    int clock_locked;
+    int64_t clock_ref_start; /* reference time and PCR when the lock was taken */
+    int64_t clock_pcr_start;
+    int64_t clock_last_ref;
+    double clock_offset;     /* Hz */
 
     int ts_type;
     int ts_id;
 
     int cbr;
+    int vbr;
+    int full_tstd;
     int ts_muxrate;
     int lowlatency;
+    int lookahead; /* in video frames */
+    int no_video_latency; /* in milliseconds */
+    int mux_delay; /* in milliseconds */
+    int fast_channel_change;
+    int shed_data_threshold;  /* in milliseconds */
+    int shed_video_threshold; /* in milliseconds */
+    int simulate;  /* analysis pass, output is discarded */
+
+    uint64_t late_packets;
+    uint64_t shed_data_frames;
+    uint64_t shed_video_frames;
+    uint64_t shed_bytes;
+    uint64_t reorder_late_frames;
+    int64_t queue_margin; /* in 27MHz ticks, as of the last write */
+    /* the queued frames in DTS order and the bytes due up to and including each of them */
+    int margin_alloced;
+    ts_int_pes_t **margin_frames;
+    int64_t *margin_bytes;
 
     int pat_cc;
 
@@ -307,23 +431,62 @@ struct ts_writer_t
     int pat_period;
     int pcr_period;
     int sdt_period;
+    int nit_period;
+    int tdt_period;
     int first_input;
 
     int pat_version;
+    int sdt_version;
+    int nit_version;
 
     int network_pid;
     int network_id;
 
     int num_buffered_frames;
+    int num_prev_buffered_frames; /* queue length before the current call */
     ts_int_pes_t **buffered_frames;
 
+    /* input frames held in DTS order until they are reorder_window behind the newest */
+    int reorder_window; /* in milliseconds */
+    int num_reorder_frames;
+    int reorder_frames_alloced;
+    ts_frame_t *reorder_frames;
+    int64_t *reorder_input_times;
+
+    /* splice_insert sections from ts_schedule_splice, passed in with the frames of the next write */
+    int num_splice_sections;
+    ts_frame_t *splice_sections;
+
+    ts_frame_done_callback_t frame_done;
+    void *frame_done_priv;
+
+    int num_carousels;
+    int next_carousel_id;
+    ts_int_carousel_t *carousels;
+
+    int num_fill_sources;
+    int last_fill_source;
+    ts_int_fill_source_t *fill_sources;
+
+    /* PAT and PMT wait for room in the system target decoder and are written ahead of the SI and
+     * application sections, which are not part of it */
+    ts_int_psi_queue_t system_queue;
+    ts_int_psi_queue_t si_queue;
+    int fcc_psi_left; /* system queue packets up to the end of the PMT sent for a fast channel change random access point */
+
     int num_pcrs;
     int pcr_list_alloced;
     int64_t *pcr_list;
 
+    /* returned by ts_save_state */
+    int state_size;
+    int state_alloced;
+    uint8_t *state;
+
     /* system control */
     buffer_t tb;     /* transport buffer */
     buffer_t main_b; /* main buffer */
+    buffer_t si_b;   /* paces the SI queue at rx_sys */
 
     int rx_sys;      /* flow from transport to main buffer */
     int r_sys;       /* flow from main buffer to system decoder */
@@ -338,14 +501,6 @@ struct ts_writer_t
     ts_int_stream_t *tdt;
     ts_int_stream_t *sit;
 
-    uint64_t last_pat;
-    uint64_t last_pmt;
-    uint64_t last_nit;
-    uint64_t last_sdt;
-    uint64_t last_eit;
-    uint64_t last_tdt;
-    uint64_t last_sit;
-
     ts_dtcp_t *dtcp_ctx;
 };
 
@@ -362,6 +517,7 @@ void write_registration_descriptor( bs_t *s, int descriptor_tag, int descriptor_
 void write_crc( bs_t *s, int start );
 int write_padding( bs_t *s, int start );
 int increase_pcr( ts_writer_t *w, int num_packets, int imaginary );
+int queue_section( ts_writer_t *w, int pid, int *cc, uint8_t *section, int length );
 ts_int_stream_t *find_stream( ts_writer_t *w, int pid );
 
 #endif
@@ -137,15 +137,10 @@ static void write_service_descriptor( bs_t *s, int service_type, char *provider_
 /* DVB Service Information */
 int write_nit( ts_writer_t *w )
 {
-    int start;
+    uint8_t nit_buf[1024];
+    bs_t q, *s = &q;
 
-    bs_t *s = &w->out.bs;
-
-    write_packet_header( w, s, 1, w->network_pid, PAYLOAD_ONLY, &w->nit->cc );
-
-    bs_write( s, 8, 0 );       // pointer field
-
-    start = bs_pos( s );
+    bs_init( s, nit_buf, sizeof(nit_buf) );
     bs_write( s, 8, NIT_TID ); // table_id = network_information_section
     bs_write1( s, 1 );         // section_syntax_indicator
     bs_write1( s, 1 );         // reserved_future_use
@@ -153,7 +148,7 @@ int write_nit( ts_writer_t *w )
     bs_write( s, 12, 0x13 );   // section_length
     bs_write( s, 16, w->network_id ); // network_id
     bs_write( s, 2, 0x02 );    // reserved
-    bs_write( s, 5, 0 );       // version_number
+    bs_write( s, 5, w->nit_version ); // version_number
     bs_write1( s, 1 );         // current_next_indicator
     bs_write(s, 8, 0 );        // section_number
     bs_write(s, 8, 0 );        // last_section_number
@@ -173,26 +168,20 @@ int write_nit( ts_writer_t *w )
     // transport descriptor(s) here
 
     bs_flush( s );
-    write_crc( s, start );
-
-    // -40 to include header and pointer field
-    write_padding( s, start - 40 );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
+    write_crc( s, 0 );
+    bs_flush( s );
 
-    return 0;
+    return queue_section( w, w->network_pid, &w->nit->cc, nit_buf, bs_pos( s ) >> 3 );
 }
 
 /* "The SDT contains data describing the services in the system e.g. names of services, the service provider, etc" */
 int write_sdt( ts_writer_t *w )
 {
-    int start;
     uint8_t *sdt_buf = NULL, *sdt_buf2 = NULL;
     int buf_size = 0;
-    int ret = 0;
+    int ret = -1;
     int section_length;
 
-    bs_t *s = &w->out.bs;
     bs_t q, r;
 
     buf_size = 200;
@@ -219,10 +208,6 @@ int write_sdt( ts_writer_t *w )
         goto end;
     }
 
-    start = bs_pos( s );
-    write_packet_header( w, s, 1, SDT_PID, PAYLOAD_ONLY, &w->sdt->cc );
-    bs_write( s, 8, 0 );         // pointer field
-
     bs_init( &q, sdt_buf, buf_size );
     bs_write( &q, 8, SDT_TID );   // table_id
     bs_write1( &q, 1 );           // section_syntax_indicator
@@ -232,7 +217,7 @@ int write_sdt( ts_writer_t *w )
     bs_init( &r, sdt_buf2, buf_size );
     bs_write( &r, 16, w->ts_id ); // transport_stream_id
     bs_write( &r, 2, 0x3 );       // reserved
-    bs_write( &r, 5, 0 );         // version_number
+    bs_write( &r, 5, w->sdt_version ); // version_number
     bs_write1( &r, 1 );           // current_next_indicator
     bs_write( &r, 8, 0 );         // section_number
     bs_write( &r, 8, 0 );         // last_section_number
@@ -278,34 +263,9 @@ int write_sdt( ts_writer_t *w )
     write_crc( &q, 0 );
 
     int length = bs_pos( &q ) >> 3;
-    int bytes_left = TS_PACKET_SIZE - (( bs_pos( s ) - start ) >> 3);
-
     bs_flush( &q );
-    write_bytes( s, sdt_buf, MIN( bytes_left, length ) );
-    bs_flush( s );
 
-    write_padding( s, start );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        goto end;
-
-    int pos = MIN( bytes_left, length );
-    length -= pos;
-
-    bytes_left = 184;
-
-    /* keep writing SDT packets */
-    while( length > 0 )
-    {
-        start = bs_pos( s );
-        write_packet_header( w, s, 0, SDT_PID, PAYLOAD_ONLY, &w->sdt->cc );
-        write_bytes( s, &sdt_buf[pos], MIN( bytes_left, length ) );
-        write_padding( s, start );
-        pos += MIN( bytes_left, length );
-        length -= MIN( bytes_left, length );
-
-        if( increase_pcr( w, 1, 0 ) < 0 )
-            goto end;
-    }
+    ret = queue_section( w, SDT_PID, &w->sdt->cc, sdt_buf, length );
 
 end:
     free( sdt_buf );
@@ -359,13 +319,10 @@ static void write_utc_time( bs_t *s )
 
 int write_tdt( ts_writer_t *w )
 {
-    int start;
-    bs_t *s = &w->out.bs;
+    uint8_t tdt_buf[16];
+    bs_t q, *s = &q;
 
-    write_packet_header( w, s, 1, TDT_PID, PAYLOAD_ONLY, &w->tdt->cc );
-    bs_write( s, 8, 0 );       // pointer field
-
-    start = bs_pos( s );
+    bs_init( s, tdt_buf, sizeof(tdt_buf) );
     bs_write( s, 8, TDT_TID ); // table_id
     bs_write1( s, 0 );         // section_syntax_indicator
     bs_write1( s, 1 );         // reserved_future_use
@@ -373,14 +330,9 @@ int write_tdt( ts_writer_t *w )
     bs_write( s, 12, 0x05 );   // section_length
 
     write_utc_time( s );
+    bs_flush( s );
 
-    // -40 to include header and pointer field
-    write_padding( s, start - 40 );
-
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
-
-    return 0;
+    return queue_section( w, TDT_PID, &w->tdt->cc, tdt_buf, bs_pos( s ) >> 3 );
 }
 
 // TODO TOT
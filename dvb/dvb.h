@@ -45,6 +45,7 @@
 #define TDT_TID         0x70
 
 /* Default Retransmit times (ms) */
+#define NIT_MAX_RETRANS_TIME          10000
 #define SDT_MAX_RETRANS_TIME          2000
 #define EIT_MAX_RETRANS_TIME          2000
 #define EIT_OTHER_TS_MAX_RETRANS_TIME 10000
@@ -28,6 +28,14 @@
 #include "smpte/smpte.h"
 #include "crc/crc.h"
 #include <math.h>
+#include <limits.h>
+#include <time.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif !defined(CLOCK_MONOTONIC)
+#include <sys/time.h>
+#endif
 
 static const int stream_type_table[30][2] =
 {
@@ -199,14 +207,17 @@ static void write_opus_descriptor( bs_t *s, ts_int_stream_t *stream )
 }
 
 /**** PCR functions ****/
-static int64_t get_pcr_int( ts_writer_t *w, double offset )
+/* Exact in integer arithmetic so the PCR does not lose precision as packets_written grows.
+ * The division is split so the multiplication cannot overflow however long the writer runs */
+static int64_t get_pcr_int( ts_writer_t *w, int64_t offset )
 {
-    return (int64_t)((8.0 * (w->packets_written * TS_PACKET_SIZE + offset) / w->ts_muxrate) * TS_CLOCK + 0.5) + w->pcr_start;
+    int64_t bits = ((int64_t)w->packets_written * TS_PACKET_SIZE + offset) * 8;
+    return bits / w->ts_muxrate * w->pcr_clock + ((bits % w->ts_muxrate) * w->pcr_clock + w->ts_muxrate / 2) / w->ts_muxrate + w->pcr_start;
 }
 
 static double get_pcr_double( ts_writer_t *w, double offset )
 {
-    return (8.0 * (w->packets_written * TS_PACKET_SIZE + offset) / w->ts_muxrate) + (double)w->pcr_start / TS_CLOCK;
+    return (8.0 * (w->packets_written * TS_PACKET_SIZE + offset) / w->ts_muxrate) * w->pcr_clock / TS_CLOCK + (double)w->pcr_start / TS_CLOCK;
 }
 
 static int check_pcr( ts_writer_t *w, ts_int_program_t *program )
@@ -220,15 +231,47 @@ static int check_pcr( ts_writer_t *w, ts_int_program_t *program )
     return 0;
 }
 
+/* Within the last part of the PCR period a packet of the PCR stream is written early if possible to carry the PCR.
+ * This avoids writing a PCR-only packet when the deadline is reached. Only the last packet of the PCR stream
+ * that can be written before the deadline is used, so the early PCR replaces a PCR-only packet instead of
+ * shortening the period while later packets could still carry it. */
+#define PCR_LOOKAHEAD_WINDOW 4
+
+static int check_pcr_lookahead( ts_writer_t *w, ts_int_program_t *program )
+{
+    int64_t period = w->pcr_period * (TS_CLOCK/1000);
+    int64_t next_pkt_pcr = get_pcr_int( w, (TS_PACKET_SIZE + 7) * 8 ) - program->last_pcr;
+    int packets = 0;
+
+    if( next_pkt_pcr < period - period / PCR_LOOKAHEAD_WINDOW )
+        return 0;
+
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->buffered_frames[i];
+
+        if( pes->stream == program->pcr_stream && pes->initial_arrival_time <= program->last_pcr + period )
+        {
+            packets += (pes->bytes_left + 183) / 184;
+            if( packets > 1 )
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
 /**** Buffer management ****/
 static void add_to_buffer( buffer_t *buffer )
 {
     buffer->cur_buf += TS_PACKET_SIZE * 8;
 }
 
-static void drip_buffer( ts_writer_t *w, ts_int_program_t *program, int rx, buffer_t *buffer, double next_pcr )
+/* returns the number of bits removed from the buffer */
+static int drip_buffer( ts_writer_t *w, ts_int_program_t *program, int rx, buffer_t *buffer, double next_pcr )
 {
     int iters;
+    int prev_buf = buffer->cur_buf;
     double offset;
 
     /* Although this uses floating point arithmetic, the values are backed by integers
@@ -248,17 +291,317 @@ static void drip_buffer( ts_writer_t *w, ts_int_program_t *program, int rx, buff
     buffer->last_byte_removal_time = next_pcr - offset;
 
     buffer->cur_buf = MAX( buffer->cur_buf, 0 );
+
+    return MAX( prev_buf - buffer->cur_buf, 0 );
+}
+
+/* TB -> MB -> EB flow of an elementary stream with removal of access units at their DTS */
+static void drip_stream_buffers( ts_writer_t *w, ts_int_program_t *program, ts_int_stream_t *stream, double next_pcr )
+{
+    /* Transport packet headers, adaptation fields and PES headers are discarded when leaving the transport buffer */
+    int bits = drip_buffer( w, program, stream->rx, &stream->tb, next_pcr );
+    int discard = MIN( bits, stream->mb_discard );
+    stream->mb_discard -= discard;
+    stream->mb.cur_buf += bits - discard;
+
+    /* video uses the leak method from the multiplex buffer to the elementary buffer */
+    if( stream->rbx )
+        stream->eb.cur_buf += drip_buffer( w, program, stream->rbx, &stream->mb, next_pcr );
+
+    while( stream->num_tstd_aus && stream->tstd_aus[0].dts * 300 <= next_pcr * TS_CLOCK )
+    {
+        int size = stream->tstd_aus[0].size;
+
+        /* anything still in the multiplex buffer at decode time is removed from there */
+        if( stream->rbx )
+        {
+            int eb_bits = MIN( size, stream->eb.cur_buf );
+            stream->eb.cur_buf -= eb_bits;
+            size -= eb_bits;
+        }
+        int mb_bits = MIN( size, stream->mb.cur_buf );
+        stream->mb.cur_buf -= mb_bits;
+        /* the rest of a late access unit is still in the transport buffer */
+        stream->mb_discard += size - mb_bits;
+
+        stream->num_tstd_aus--;
+        memmove( &stream->tstd_aus[0], &stream->tstd_aus[1], stream->num_tstd_aus * sizeof(stream->tstd_aus[0]) );
+    }
+}
+
+/* queued when the first byte of the access unit enters the transport buffer */
+static int queue_access_unit( ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
+
+    if( stream->num_tstd_aus == stream->tstd_aus_alloced )
+    {
+        int alloced = MAX( stream->tstd_aus_alloced * 2, 16 );
+        tstd_au_t *tmp = realloc( stream->tstd_aus, alloced * sizeof(stream->tstd_aus[0]) );
+        if( !tmp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        stream->tstd_aus = tmp;
+        stream->tstd_aus_alloced = alloced;
+    }
+
+    stream->tstd_aus[stream->num_tstd_aus].dts = pes->dts;
+    stream->tstd_aus[stream->num_tstd_aus].size = (pes->size - pes->header_size) * 8;
+    stream->num_tstd_aus++;
+
+    return 0;
+}
+
+/* a chunk has been added to a frame whose access unit has already entered the T-STD */
+static void grow_access_unit( ts_int_pes_t *pes, int bits )
+{
+    ts_int_stream_t *stream = pes->stream;
+
+    if( stream->num_tstd_aus && stream->tstd_aus[stream->num_tstd_aus-1].dts == pes->dts )
+        stream->tstd_aus[stream->num_tstd_aus-1].size += bits;
+    else
+        stream->mb_discard += bits; /* already removed at its decode time */
+}
+
+/* a packet carrying written bytes of pes, starting at offset, has entered the transport buffer */
+static void add_to_stream_buffers( ts_int_stream_t *stream, ts_int_pes_t *pes, int offset, int written )
+{
+    int header_bytes = MAX( MIN( offset + written, pes->header_size ) - offset, 0 );
+
+    add_to_buffer( &stream->tb );
+    add_to_buffer( &stream->rate_b );
+    stream->mb_discard += (TS_PACKET_SIZE - written + header_bytes) * 8;
+}
+
+/* whether the next PSI/SI packet can enter the system target decoder */
+static int system_has_room( ts_writer_t *w )
+{
+    if( w->main_b.cur_buf + 184 * 8 > w->main_b.buf_size )
+        return 0;
+
+    if( !w->full_tstd )
+        return w->tb.cur_buf == 0.0;
+
+    return w->tb.cur_buf + TS_PACKET_SIZE * 8 <= w->tb.buf_size;
+}
+
+/* SI is written a packet at a time at no more than rx_sys so that a large table cannot crowd out the streams */
+static int si_has_room( ts_writer_t *w )
+{
+    return w->si_b.cur_buf == 0.0;
+}
+
+/* whether the next packet of a stream can enter the T-STD */
+static int stream_has_room( ts_writer_t *w, ts_int_stream_t *stream )
+{
+    if( stream->max_bitrate && stream->rate_b.cur_buf + TS_PACKET_SIZE * 8 > stream->rate_b.buf_size )
+        return 0;
+
+    if( !w->full_tstd )
+        return stream->tb.cur_buf == 0.0;
+
+    /* everything in the multiplex buffer of a video stream is on its way to the elementary buffer */
+    return stream->tb.cur_buf + TS_PACKET_SIZE * 8 <= stream->tb.buf_size &&
+           ( !stream->mb.buf_size || stream->mb.cur_buf + 184 * 8 <= stream->mb.buf_size ) &&
+           ( !stream->rbx || !stream->eb.buf_size || stream->eb.cur_buf + stream->mb.cur_buf + 184 * 8 <= stream->eb.buf_size );
+}
+
+static void drip_buffers( ts_writer_t *w, ts_int_program_t *program, double next_pcr )
+{
+    /* system target decoder */
+    int bits = drip_buffer( w, program, w->rx_sys, &w->tb, next_pcr );
+    w->main_b.cur_buf += (int64_t)bits * 184 / TS_PACKET_SIZE;
+    drip_buffer( w, program, w->r_sys, &w->main_b, next_pcr );
+    drip_buffer( w, program, w->rx_sys, &w->si_b, next_pcr );
+
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        if( program->streams[i]->max_bitrate )
+            drip_buffer( w, program, program->streams[i]->max_bitrate, &program->streams[i]->rate_b, next_pcr );
+
+        /* SCTE35 is PSI so not part of T-STD */
+        if( program->streams[i]->stream_format == LIBMPEGTS_DATA_SCTE35 )
+            program->streams[i]->tb.cur_buf = program->streams[i]->mb_discard = 0;
+        else
+            drip_stream_buffers( w, program, program->streams[i], next_pcr );
+    }
+}
+
+/* time at which a buffer draining at rx will have dropped below size */
+static int64_t buffer_drain_time( buffer_t *buffer, int rx, int size )
+{
+    if( buffer->cur_buf <= size )
+        return 0;
+
+    return (int64_t)ceil( (buffer->last_byte_removal_time + (double)(buffer->cur_buf - size) / rx) * TS_CLOCK );
+}
+
+/* lower bound on the time at which system_has_room() becomes true */
+static int64_t system_room_time( ts_writer_t *w )
+{
+    int64_t room_time = buffer_drain_time( &w->main_b, w->r_sys, w->main_b.buf_size - 184 * 8 );
+
+    if( !w->full_tstd )
+        return MAX( room_time, buffer_drain_time( &w->tb, w->rx_sys, 0 ) );
+
+    return MAX( room_time, buffer_drain_time( &w->tb, w->rx_sys, w->tb.buf_size - TS_PACKET_SIZE * 8 ) );
+}
+
+/* time at which si_has_room() becomes true */
+static int64_t si_room_time( ts_writer_t *w )
+{
+    return buffer_drain_time( &w->si_b, w->rx_sys, 0 );
+}
+
+/* lower bound on the time at which stream_has_room() becomes true */
+static int64_t stream_room_time( ts_writer_t *w, ts_int_stream_t *stream )
+{
+    int64_t room_time = 0;
+
+    if( stream->max_bitrate )
+        room_time = buffer_drain_time( &stream->rate_b, stream->max_bitrate, stream->rate_b.buf_size - TS_PACKET_SIZE * 8 );
+
+    if( !w->full_tstd )
+        return MAX( room_time, buffer_drain_time( &stream->tb, stream->rx, 0 ) );
+
+    room_time = MAX( room_time, buffer_drain_time( &stream->tb, stream->rx, stream->tb.buf_size - TS_PACKET_SIZE * 8 ) );
+
+    if( stream->mb.buf_size && stream->mb.cur_buf + 184 * 8 > stream->mb.buf_size )
+    {
+        /* further input only delays this */
+        int64_t mb_time = stream->num_tstd_aus ? stream->tstd_aus[0].dts * 300 : INT64_MAX;
+        if( stream->rbx )
+            mb_time = MIN( mb_time, buffer_drain_time( &stream->mb, stream->rbx, stream->mb.buf_size - 184 * 8 ) );
+        room_time = MAX( room_time, mb_time );
+    }
+
+    /* only removing an access unit makes room in the elementary buffer */
+    if( stream->rbx && stream->eb.buf_size && stream->eb.cur_buf + stream->mb.cur_buf + 184 * 8 > stream->eb.buf_size )
+        room_time = MAX( room_time, stream->num_tstd_aus ? stream->tstd_aus[0].dts * 300 : INT64_MAX );
+
+    return room_time;
+}
+
+/* size in bytes of the adaptation field extension written before a splice point */
+static int splice_extension_size( ts_int_stream_t *stream )
+{
+    if( !stream->splice_seamless && !stream->splice_ltw && !stream->splice_piecewise_rate )
+        return 0;
+
+    return 2 + 2 * stream->splice_ltw + 3 * stream->splice_piecewise_rate + 5 * stream->splice_seamless;
+}
+
+static void write_splice_extension( ts_writer_t *w, bs_t *s, ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
+
+    bs_write( s, 8, splice_extension_size( stream ) - 1 ); // adaptation_field_extension_length
+    bs_write1( s, stream->splice_ltw );            // ltw_flag
+    bs_write1( s, stream->splice_piecewise_rate ); // piecewise_rate_flag
+    bs_write1( s, stream->splice_seamless );       // seamless_splice_flag
+    bs_write( s, 5, 0x1f );                        // reserved
+
+    if( stream->splice_ltw )
+    {
+        /* time until the access unit is decoded */
+        int64_t offset = (pes->dts * 300 - get_pcr_int( w, 0 )) / 300;
+        bs_write1( s, 1 ); // ltw_valid_flag
+        bs_write( s, 15, MIN( MAX( offset, 0 ), 0x7fff ) ); // ltw_offset
+    }
+
+    if( stream->splice_piecewise_rate )
+    {
+        /* in units of 50 bytes/s */
+        int64_t rate = 0;
+        if( pes->final_arrival_time > pes->initial_arrival_time )
+            rate = (int64_t)pes->size * TS_CLOCK / (pes->final_arrival_time - pes->initial_arrival_time) / 50;
+        bs_write( s, 2, 0x3 ); // reserved
+        bs_write( s, 22, MIN( rate, 0x3fffff ) ); // piecewise_rate
+    }
+
+    if( stream->splice_seamless )
+    {
+        int64_t dts = stream->splice_dts_next_au % TIMESTAMP_MOD;
+        bs_write( s, 4, stream->splice_type );  // splice_type
+        bs_write( s, 3, (dts >> 30) & 0x07 );   // DTS_next_AU[32..30]
+        bs_write1( s, 1 );                      // marker_bit
+        bs_write( s, 15, (dts >> 15) & 0x7fff );// DTS_next_AU[29..15]
+        bs_write1( s, 1 );                      // marker_bit
+        bs_write( s, 15, dts & 0x7fff );        // DTS_next_AU[14..0]
+        bs_write1( s, 1 );                      // marker_bit
+    }
+}
+
+/* Decide whether the next packet of a pes is part of a splice.
+ * splice_countdown runs over the packets of the last access unit before the splice point and the first packet of
+ * the new source has a splice_countdown of -1 */
+static int check_splice( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
+
+    if( !stream->splice_pending )
+        return 0;
+
+    if( pes->data == pes->cur_pos )
+    {
+        ts_int_pes_t *next = NULL;
+
+        if( pes->pts >= stream->splice_pts )
+        {
+            if( IS_VIDEO( stream ) && !pes->random_access )
+                fprintf( stderr, "Splice point on PID %i is not a random access point\n", stream->pid );
+            stream->splice_pending = 0;
+            stream->splice_countdown = -1;
+            return stream->splice_point_flag = 1;
+        }
+
+        /* the splice point follows this access unit if the next one is from the new source */
+        for( int i = 0; i < w->num_buffered_frames; i++ )
+        {
+            if( w->buffered_frames[i] == pes )
+            {
+                for( int j = i + 1; j < w->num_buffered_frames && !next; j++ )
+                {
+                    if( w->buffered_frames[j]->stream == stream )
+                        next = w->buffered_frames[j];
+                }
+                break;
+            }
+        }
+
+        stream->splice_point_flag = next && next->pts >= stream->splice_pts;
+        if( stream->splice_point_flag )
+            stream->splice_dts_next_au = next->dts;
+    }
+
+    return stream->splice_point_flag;
+}
+
+/* number of packets with payload after this one until the end of the access unit before the splice point */
+static int splice_countdown( ts_int_stream_t *stream, int bytes_after )
+{
+    /* adaptation_field_length, flags and splice_countdown */
+    int payload = 184 - 3 - splice_extension_size( stream );
+
+    return bytes_after > 0 ? MIN( (bytes_after + payload - 1) / payload, 127 ) : 0;
 }
 
 static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *program, ts_int_pes_t *pes,
                                    int write_pcr, int flags, int stuffing, int discontinuity )
 {
-    int private_data_flag, write_dvb_au, random_access, priority;
+    int private_data_flag, write_dvb_au, random_access, priority, splicing, write_extension;
     int start = bs_pos( s );
     uint8_t temp[512], temp2[256];
     bs_t q, r;
+    ts_int_stream_t *splice_stream = pes ? pes->stream : NULL;
 
     private_data_flag = write_dvb_au = random_access = priority = 0;
+    splicing = splice_stream && splice_stream->splice_point_flag;
+    /* the extension describes the splice point so goes in the packets leading up to it */
+    write_extension = splicing && splice_stream->splice_countdown >= 0 &&
+                ( splice_stream->splice_seamless || splice_stream->splice_ltw || splice_stream->splice_piecewise_rate );
 
     if( pes && ( pes->data == pes->cur_pos ) )
     {
@@ -274,7 +617,6 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
         }
 
         priority = pes->priority;
-        pes->random_access = 0; /* don't write this flag again */
     }
 
     /* initialise temporary bitstream */
@@ -288,17 +630,16 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
         bs_write1( &q, priority );  // elementary_stream_priority_indicator
         bs_write1( &q, write_pcr ); // PCR_flag
         bs_write1( &q, 0 ); // OPCR_flag
-        bs_write1( &q, 0 ); // splicing_point_flag
+        bs_write1( &q, splicing ); // splicing_point_flag
         bs_write1( &q, private_data_flag ); // transport_private_data_flag
-        bs_write1( &q, 0 ); // adaptation_field_extension_flag
+        bs_write1( &q, write_extension ); // adaptation_field_extension_flag
         if( write_pcr )
         {
              uint64_t base, extension;
-             int64_t mod = (int64_t)1 << 33;
 
              program->last_pcr = pcr;
 
-             base = (pcr / 300) % mod;
+             base = (pcr / 300) % TIMESTAMP_MOD;
              extension = pcr % 300;
 
              // program_clock_reference_base
@@ -310,6 +651,9 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
              bs_write( &q, 8, (extension >> 1) & 0xff );
              bs_write1( &q, (extension & 1 ) );
         }
+
+        if( splicing )
+            bs_write( &q, 8, splice_stream->splice_countdown & 0xff ); // splice_countdown
     }
 
     if( private_data_flag )
@@ -325,6 +669,9 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
         write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
     }
 
+    if( write_extension )
+        write_splice_extension( w, &q, pes );
+
     for( int i = 0; i < stuffing; i++ )
         bs_write( &q, 8, 0xff );
 
@@ -344,6 +691,7 @@ static int write_pcr_empty( ts_writer_t *w, ts_int_program_t *program, int first
     write_adaptation_field( w, s, program, NULL, 1, 1, stuffing, first );
 
     add_to_buffer( &program->pcr_stream->tb );
+    program->pcr_stream->mb_discard += TS_PACKET_SIZE * 8;
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
@@ -351,22 +699,141 @@ static int write_pcr_empty( ts_writer_t *w, ts_int_program_t *program, int first
 }
 
 /**** PSI ****/
-static int write_pat( ts_writer_t *w )
+/* PAT and PMT are the only tables covered by the system target decoder */
+static ts_int_psi_queue_t *psi_queue( ts_writer_t *w, int pid )
 {
-    int start;
-    bs_t *s = &w->out.bs;
+    if( pid == PAT_PID )
+        return &w->system_queue;
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        if( w->programs[i]->pmt.pid == pid )
+            return &w->system_queue;
+    }
 
-    write_packet_header( w, s, 1, PAT_PID, PAYLOAD_ONLY, &w->pat_cc );
-    bs_write( s, 8, 0 ); // pointer field
+    return &w->si_queue;
+}
 
-    start = bs_pos( s );
+static int psi_queued( ts_int_psi_queue_t *queue )
+{
+    return queue->num_packets - queue->read_pos;
+}
+
+/* split a complete section into packets which are queued until they can be written */
+int queue_section( ts_writer_t *w, int pid, int *cc, uint8_t *section, int length )
+{
+    ts_int_psi_queue_t *queue = psi_queue( w, pid );
+    int hdr = w->ts_type == TS_TYPE_BLU_RAY ? 4 : 0; /* tp_extra_header */
+    int num_packets, pos = 0;
+
+    /* Start the section in the stuffing of the last queued packet if it is on the same PID */
+    if( psi_queued( queue ) )
+    {
+        uint8_t *tail = &queue->packets[(queue->num_packets - 1) * TS_PACKET_SIZE];
+        int tail_pid = ((tail[hdr+1] & 0x1f) << 8) | tail[hdr+2];
+        int pusi = !!(tail[hdr+1] & 0x40);
+        int used = queue->tail_used;
+
+        /* a pointer_field is needed if no section starts in the packet yet.
+         * Don't split the first three bytes of a section so that the section_length can be read */
+        if( tail_pid == pid && TS_PACKET_SIZE - used - !pusi >= 3 )
+        {
+            if( !pusi )
+            {
+                /* the pointer_field skips the end of the previous section */
+                memmove( &tail[hdr+5], &tail[hdr+4], used - hdr - 4 );
+                tail[hdr+4] = used - hdr - 4;
+                tail[hdr+1] |= 0x40; // payload_unit_start_indicator
+                used++;
+            }
+
+            pos = MIN( length, TS_PACKET_SIZE - used );
+            memcpy( &tail[used], section, pos );
+            queue->tail_used = used + pos;
+        }
+    }
+
+    num_packets = (length - pos + !pos + 183) / 184; /* including pointer_field */
+
+    if( queue->num_packets + num_packets > queue->packets_alloced )
+    {
+        /* discard packets that have been written */
+        queue->num_packets -= queue->read_pos;
+        memmove( queue->packets, &queue->packets[queue->read_pos * TS_PACKET_SIZE], queue->num_packets * TS_PACKET_SIZE );
+        queue->read_pos = 0;
+    }
+
+    if( queue->num_packets + num_packets > queue->packets_alloced )
+    {
+        int alloced = MAX( queue->packets_alloced * 2, queue->num_packets + num_packets );
+        uint8_t *tmp = realloc( queue->packets, alloced * TS_PACKET_SIZE );
+        if( !tmp )
+        {
+            fprintf( stderr, "malloc failed\n" );
+            return -1;
+        }
+        queue->packets = tmp;
+        queue->packets_alloced = alloced;
+    }
+
+    for( int i = 0; i < num_packets; i++ )
+    {
+        /* the bitstream writer reads ahead so the packet is assembled in a larger buffer */
+        uint8_t temp[TS_PACKET_SIZE + 16];
+        bs_t s;
+        int start = !pos;
+        int bytes = MIN( length - pos, 184 - start );
+
+        bs_init( &s, temp, sizeof(temp) );
+        write_packet_header( w, &s, start, pid, PAYLOAD_ONLY, cc );
+        if( start )
+            bs_write( &s, 8, 0 ); // pointer field
+        write_bytes( &s, &section[pos], bytes );
+        queue->tail_used = bs_pos( &s ) >> 3;
+        write_padding( &s, 0 );
+        memcpy( &queue->packets[(queue->num_packets + i) * TS_PACKET_SIZE], temp, TS_PACKET_SIZE );
+        pos += bytes;
+    }
+
+    queue->num_packets += num_packets;
+
+    return 0;
+}
+
+static int eject_queued_psi( ts_writer_t *w, ts_int_psi_queue_t *queue )
+{
+    write_bytes( &w->out.bs, &queue->packets[queue->read_pos++ * TS_PACKET_SIZE], TS_PACKET_SIZE );
+    queue->num_sent++;
+    if( queue->read_pos == queue->num_packets )
+        queue->read_pos = queue->num_packets = 0;
+
+    if( queue == &w->system_queue )
+    {
+        if( w->fcc_psi_left )
+            w->fcc_psi_left--;
+        add_to_buffer( &w->tb );
+    }
+    else
+        add_to_buffer( &w->si_b );
+    if( increase_pcr( w, 1, 0 ) < 0 )
+        return -1;
+
+    return 0;
+}
+
+static int write_pat( ts_writer_t *w )
+{
+    uint8_t pat_buf[1024];
+    bs_t o, *s = &o;
+
+    bs_init( s, pat_buf, sizeof(pat_buf) );
     bs_write( s, 8, PAT_TID ); // table_id
     bs_write1( s, 1 );      // section_syntax_indicator
     bs_write1( s, 0 );      // '0'
     bs_write( s, 2, 0x03 ); // reserved`
 
     // FIXME when multiple programs are allowed do this properly
-    int section_length = w->num_programs * 4 + w->network_pid * 4 + 9;
+    int section_length = w->num_programs * 4 + !!w->network_pid * 4 + 9;
     bs_write( s, 12, section_length & 0x3ff );
 
     bs_write( s, 16, w->ts_id & 0xffff ); // transport_stream_id
@@ -391,56 +858,17 @@ static int write_pat( ts_writer_t *w )
     }
 
     bs_flush( s );
-    write_crc( s, start );
-
-    // -40 to include header and pointer field
-    write_padding( s, start - 40 );
-    add_to_buffer( &w->tb );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
+    write_crc( s, 0 );
+    bs_flush( s );
 
-    return 0;
+    return queue_section( w, PAT_PID, &w->pat_cc, pat_buf, bs_pos( s ) >> 3 );
 }
 
-static int eject_queued_pmt( ts_writer_t *w, ts_int_program_t *program, bs_t *s )
-{
-    uint8_t **temp;
-
-    write_bytes( s, program->pmt_packets[0], TS_PACKET_SIZE );
-
-    if( program->num_queued_pmt > 1 )
-        memmove( &program->pmt_packets[0], &program->pmt_packets[1], (program->num_queued_pmt-1) * sizeof(uint8_t*) );
-
-    temp = realloc( program->pmt_packets, (program->num_queued_pmt-1) * sizeof(uint8_t*) );
-    program->pmt_packets = temp;
-
-    program->num_queued_pmt--;
-
-    add_to_buffer( &w->tb );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
-
-    return 0;
-};
-
 static int write_pmt( ts_writer_t *w, ts_int_program_t *program )
 {
-    int start;
-    bs_t *s = &w->out.bs;
-
     uint8_t pmt_buf[2048] = {0}, temp[2048] = {0}, temp1[2048] = {0};
     bs_t o, p, q;
     int section_length;
-    uint8_t **temp2;
-
-    /* this should never happen */
-    if( program->num_queued_pmt )
-        return eject_queued_pmt( w, program, s );
-
-    start = bs_pos( s );
-    write_packet_header( w, s, 1, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
-
-    bs_write( s, 8, 0 );       // pointer field
 
     bs_init( &o, pmt_buf, 2048 );
 
@@ -611,74 +1039,317 @@ static int write_pmt( ts_writer_t *w, ts_int_program_t *program )
     write_crc( &o, 0 );
 
     int length = bs_pos( &o ) >> 3;
-    int bytes_left = TS_PACKET_SIZE - ((bs_pos( s ) - start) >> 3);
-
     bs_flush( &o );
-    write_bytes( s, pmt_buf, MIN( bytes_left, length ) );
-    bs_flush( s );
-
-    write_padding( s, start );
-    add_to_buffer( &w->tb );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
-
-    int pos = MIN( bytes_left, length );
-    length -= pos;
 
-    bytes_left = 184;
-
-    /* queue up pmt packets for spaced output */
-    while( length > 0 )
-    {
-        bs_t z;
+    return queue_section( w, program->pmt.pid, &program->pmt.cc, pmt_buf, length );
+}
 
-        temp2 = realloc( program->pmt_packets, (program->num_queued_pmt + 1) * sizeof(uint8_t*));
-        if( !temp2 )
-        {
-            fprintf( stderr, "malloc failed" );
-            return -1;
-        }
-        program->pmt_packets = temp2;
+/**** Section carousels ****/
+static void *dup_mem( void *src, size_t size )
+{
+    void *dst;
 
-        program->pmt_packets[program->num_queued_pmt] = malloc( TS_PACKET_SIZE );
-        if( !program->pmt_packets[program->num_queued_pmt] )
-        {
-            fprintf( stderr, "malloc failed" );
-            return -1;
-        }
+    if( !src )
+        return NULL;
 
-        bs_init( &z, program->pmt_packets[program->num_queued_pmt], 188 );
+    dst = malloc( size );
+    if( dst )
+        memcpy( dst, src, size );
 
-        write_packet_header( w, &z, 0, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
-        write_bytes( &z, &pmt_buf[pos], MIN( bytes_left, length ) );
-        bs_flush( &z );
-        write_padding( &z, 0 );
-        pos += MIN( bytes_left, length );
-        length -= MIN( bytes_left, length );
-        program->num_queued_pmt++;
-    }
-    return 0;
+    return dst;
 }
 
-static void retransmit_psi_and_si( ts_writer_t *w, ts_int_program_t *program )
+static int carousel_period( ts_writer_t *w, ts_int_carousel_t *carousel )
 {
-    // TODO make this work with multiple programs
-    int64_t cur_pcr = get_pcr_int( w, 0 );
-    if( cur_pcr - w->last_pat >= w->pat_period * 27000LL || !w->last_pat )
+    switch( carousel->table )
     {
-        /* Although it is not in line with the mux strategy it is good practice to write PAT and PMT together */
-        w->last_pat = cur_pcr;
-        write_pat( w );          // FIXME handle failure
-        write_pmt( w, program ); // FIXME handle failure
+        case CAROUSEL_PAT:
+        case CAROUSEL_PMT:
+            return w->pat_period;
+        case CAROUSEL_SDT:
+            return w->sdt_period;
+        case CAROUSEL_NIT:
+            return w->nit_period;
+        case CAROUSEL_TDT:
+            return w->tdt_period;
+        default:
+            return carousel->period;
     }
+}
 
-    cur_pcr = get_pcr_int( w, 0 );
+static int64_t carousel_bitrate( ts_writer_t *w, ts_int_carousel_t *carousel )
+{
+    int64_t bitrate = (int64_t)MAX( carousel->num_packets, 1 ) * TS_PACKET_SIZE * 8 * 1000 / carousel_period( w, carousel );
 
-    if( w->sdt && ( cur_pcr - w->last_sdt >= w->sdt_period * 27000LL || !w->last_sdt ) )
-    {
-        w->last_sdt = cur_pcr;
-        write_sdt( w );
-    }
+    return carousel->max_bitrate ? MIN( bitrate, carousel->max_bitrate ) : bitrate;
+}
+
+/* the carousels have to fit the rates their queues are written at: PAT and PMT leave Bsys at r_sys
+ * and SI is paced at rx_sys */
+static int check_carousel_bitrate( ts_writer_t *w )
+{
+    int64_t system = 0, si = 0;
+
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        if( psi_queue( w, w->carousels[i].pid ) == &w->system_queue )
+            system += carousel_bitrate( w, &w->carousels[i] );
+        else
+            si += carousel_bitrate( w, &w->carousels[i] );
+    }
+
+    if( system * 184 / TS_PACKET_SIZE > w->r_sys )
+    {
+        fprintf( stderr, "PAT and PMT exceed the system decoder rate of %i bits/s\n", w->r_sys );
+        return -1;
+    }
+
+    if( si > w->rx_sys )
+    {
+        fprintf( stderr, "Section carousels exceed the SI rate of %i bits/s\n", w->rx_sys );
+        return -1;
+    }
+
+    if( system + si > w->ts_muxrate )
+    {
+        fprintf( stderr, "Section carousels exceed the muxrate\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* application supplied carousels on the same PID share the continuity counter of the first one */
+static int *carousel_cc( ts_writer_t *w, ts_int_carousel_t *carousel )
+{
+    switch( carousel->table )
+    {
+        case CAROUSEL_PAT:
+            return &w->pat_cc;
+        case CAROUSEL_PMT:
+            return &w->programs[carousel->program]->pmt.cc;
+        case CAROUSEL_SDT:
+            return &w->sdt->cc;
+        case CAROUSEL_NIT:
+            return &w->nit->cc;
+        case CAROUSEL_TDT:
+            return &w->tdt->cc;
+    }
+
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        if( w->carousels[i].table == CAROUSEL_SECTIONS && w->carousels[i].pid == carousel->pid )
+            return &w->carousels[i].cc;
+    }
+
+    return &carousel->cc;
+}
+
+static ts_int_carousel_t *add_carousel( ts_writer_t *w, int table, int pid )
+{
+    ts_int_carousel_t *carousel;
+    ts_int_carousel_t *tmp = realloc( w->carousels, (w->num_carousels + 1) * sizeof(*w->carousels) );
+    if( !tmp )
+    {
+        fprintf( stderr, "malloc failed\n" );
+        return NULL;
+    }
+    w->carousels = tmp;
+
+    carousel = &w->carousels[w->num_carousels++];
+    memset( carousel, 0, sizeof(*carousel) );
+    carousel->id = w->next_carousel_id++;
+    carousel->table = table;
+    carousel->pid = pid;
+
+    return carousel;
+}
+
+static ts_int_carousel_t *find_carousel( ts_writer_t *w, int table, int id )
+{
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        if( w->carousels[i].table == table && ( table != CAROUSEL_SECTIONS || w->carousels[i].id == id ) )
+            return &w->carousels[i];
+    }
+
+    return NULL;
+}
+
+static void free_sections( ts_int_carousel_t *carousel )
+{
+    for( int i = 0; i < carousel->num_sections; i++ )
+        free( carousel->sections[i] );
+    free( carousel->sections );
+    free( carousel->section_lengths );
+
+    carousel->num_sections = 0;
+    carousel->sections = NULL;
+    carousel->section_lengths = NULL;
+}
+
+static int copy_sections( ts_int_carousel_t *carousel, int num_sections, uint8_t **sections, int *section_lengths )
+{
+    carousel->sections = calloc( num_sections, sizeof(*carousel->sections) );
+    carousel->section_lengths = malloc( num_sections * sizeof(*carousel->section_lengths) );
+    if( !carousel->sections || !carousel->section_lengths )
+        goto fail;
+
+    carousel->num_sections = num_sections;
+    carousel->num_packets = 0;
+    for( int i = 0; i < num_sections; i++ )
+    {
+        carousel->sections[i] = dup_mem( sections[i], section_lengths[i] );
+        if( !carousel->sections[i] )
+            goto fail;
+        carousel->section_lengths[i] = section_lengths[i];
+        carousel->num_packets += (section_lengths[i] + 1 + 183) / 184;
+    }
+
+    return 0;
+
+fail:
+    fprintf( stderr, "malloc failed\n" );
+    free_sections( carousel );
+    return -1;
+}
+
+static void remove_carousel( ts_writer_t *w, ts_int_carousel_t *carousel )
+{
+    int idx = carousel - w->carousels;
+
+    /* hand the continuity counter on to the next carousel on the PID */
+    if( carousel->table == CAROUSEL_SECTIONS && carousel_cc( w, carousel ) == &carousel->cc )
+    {
+        for( int i = idx + 1; i < w->num_carousels; i++ )
+        {
+            if( w->carousels[i].table == CAROUSEL_SECTIONS && w->carousels[i].pid == carousel->pid )
+            {
+                w->carousels[i].cc = carousel->cc;
+                break;
+            }
+        }
+    }
+
+    free_sections( carousel );
+
+    w->num_carousels--;
+    memmove( &w->carousels[idx], &w->carousels[idx+1], (w->num_carousels - idx) * sizeof(*w->carousels) );
+}
+
+/* whether the copy of a carousel sent last time is still queued */
+static int carousel_pending( ts_writer_t *w, ts_int_carousel_t *carousel )
+{
+    return psi_queue( w, carousel->pid )->num_sent < carousel->queued_until;
+}
+
+/* a carousel whose last copy is still queued is not queued again, that copy is sent instead */
+static int send_carousel( ts_writer_t *w, ts_int_carousel_t *carousel )
+{
+    ts_int_psi_queue_t *queue = psi_queue( w, carousel->pid );
+    int num_queued = psi_queued( queue );
+    int ret = 0;
+
+    if( carousel_pending( w, carousel ) )
+        return 0;
+
+    if( carousel->table == CAROUSEL_PAT )
+        ret = write_pat( w );
+    else if( carousel->table == CAROUSEL_PMT )
+        ret = write_pmt( w, w->programs[carousel->program] );
+    else if( carousel->table == CAROUSEL_SDT )
+        ret = write_sdt( w );
+    else if( carousel->table == CAROUSEL_NIT )
+        ret = write_nit( w );
+    else if( carousel->table == CAROUSEL_TDT )
+        ret = write_tdt( w );
+    else
+    {
+        for( int i = 0; i < carousel->num_sections && !ret; i++ )
+            ret = queue_section( w, carousel->pid, carousel_cc( w, carousel ), carousel->sections[i], carousel->section_lengths[i] );
+    }
+
+    carousel->num_packets = psi_queued( queue ) - num_queued;
+    carousel->queued_until = queue->num_sent + psi_queued( queue );
+
+    return ret;
+}
+
+/* a carousel has just been sent at cur_pcr */
+static void reschedule_carousel( ts_writer_t *w, ts_int_carousel_t *carousel, int64_t cur_pcr )
+{
+    carousel->next_send = cur_pcr + carousel_period( w, carousel ) * 27000LL;
+
+    /* stretch the period if the table has outgrown its bitrate budget */
+    if( carousel->max_bitrate )
+        carousel->next_send = MAX( carousel->next_send, cur_pcr + (int64_t)carousel->num_packets * TS_PACKET_SIZE * 8 * TS_CLOCK / carousel->max_bitrate );
+}
+
+/* PSI and SI are queued here by earliest deadline and spread out by the scheduler according to the system target decoder */
+static int retransmit_psi_and_si( ts_writer_t *w )
+{
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+
+    while( 1 )
+    {
+        ts_int_carousel_t *carousel = NULL;
+
+        /* ties are broken in order of registration so the PMT follows the PAT.
+         * A carousel that is due while its last copy is still queued waits for that copy to be written */
+        for( int i = 0; i < w->num_carousels; i++ )
+        {
+            if( w->carousels[i].next_send <= cur_pcr && ( !carousel || w->carousels[i].next_send < carousel->next_send ) &&
+                !carousel_pending( w, &w->carousels[i] ) )
+                carousel = &w->carousels[i];
+        }
+
+        if( !carousel )
+            break;
+
+        if( send_carousel( w, carousel ) < 0 )
+            return -1;
+
+        reschedule_carousel( w, carousel, cur_pcr );
+    }
+
+    return 0;
+}
+
+/* Fast channel change: send the PAT and PMT now. Their retransmit timers restart from here */
+static int send_fcc_psi( ts_writer_t *w )
+{
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+    int types[2] = { CAROUSEL_PAT, CAROUSEL_PMT };
+
+    for( int i = 0; i < 2; i++ )
+    {
+        ts_int_carousel_t *carousel = find_carousel( w, types[i], 0 );
+        if( !carousel )
+            continue;
+
+        if( send_carousel( w, carousel ) < 0 )
+            return -1;
+
+        reschedule_carousel( w, carousel, cur_pcr );
+    }
+
+    /* The system queue only holds PAT and PMT and is written ahead of SI, so the random access point
+     * waits for the copies in it and not for any SI backlog. A copy that was already queued is not repeated */
+    w->fcc_psi_left = psi_queued( &w->system_queue );
+
+    return 0;
+}
+
+/* whether the next packet of a pes starts a random access point which needs PSI and a PCR in front of it */
+static int is_fcc_point( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    return w->fast_channel_change && IS_VIDEO( pes->stream ) && pes->random_access && pes->data == pes->cur_pos;
+}
+
+/* the random access point waits for its PSI unless it is already late */
+static int fcc_hold( ts_writer_t *w, ts_int_pes_t *pes, int64_t cur_pcr )
+{
+    return is_fcc_point( w, pes ) && pes->fcc_psi_sent && w->fcc_psi_left && pes->final_arrival_time >= cur_pcr;
 }
 
 /* DVB / Blu-Ray Service Information */
@@ -749,7 +1420,6 @@ static int write_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *in_
     bs_t s, q;
     uint8_t temp[1024];
     int header_size, total_size;
-    int64_t mod = (int64_t)1 << 33;
 
     if( out_pes->dts > out_pes->pts )
         fprintf( stderr, "\nError: DTS > PTS\n" );
@@ -793,12 +1463,12 @@ static int write_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *in_
 
     bs_write( &q, 4, 0x02 + !same_timestamps ); // '0010' or '0011'
 
-    write_timestamp( &q, out_pes->pts % mod );  // PTS
+    write_timestamp( &q, out_pes->pts % TIMESTAMP_MOD );  // PTS
 
     if( !same_timestamps )
     {
         bs_write( &q, 4, 1 );                      // '0001'
-        write_timestamp( &q, out_pes->dts % mod ); // DTS
+        write_timestamp( &q, out_pes->dts % TIMESTAMP_MOD ); // DTS
     }
 
     if( stream->stream_format == LIBMPEGTS_VIDEO_DIRAC )
@@ -863,6 +1533,64 @@ static int write_null_packet( ts_writer_t *w )
     return 0;
 }
 
+static ts_int_fill_source_t *find_fill_source( ts_writer_t *w, int pid )
+{
+    for( int i = 0; i < w->num_fill_sources; i++ )
+    {
+        if( w->fill_sources[i].pid == pid )
+            return &w->fill_sources[i];
+    }
+
+    return NULL;
+}
+
+/* Fill sources are served in turn, subject to their bitrate caps. They are outside the T-STD of the program.
+ * Returns 1 if a packet was written */
+static int write_fill_packet( ts_writer_t *w )
+{
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+    bs_t *s = &w->out.bs;
+
+    for( int i = 1; i <= w->num_fill_sources; i++ )
+    {
+        int idx = (w->last_fill_source + i) % w->num_fill_sources;
+        ts_int_fill_source_t *source = &w->fill_sources[idx];
+        uint8_t *pkt;
+
+        if( source->read_pos == source->num_packets || source->next_send > cur_pcr )
+            continue;
+
+        pkt = &source->packets[source->read_pos++ * TS_PACKET_SIZE];
+
+        if( w->ts_type == TS_TYPE_BLU_RAY )
+            bs_write32( s, 0 ); // tp_extra_header
+
+        /* rewrite the PID and continuity counter */
+        bs_write( s, 8, pkt[0] );
+        bs_write( s, 3, pkt[1] >> 5 );
+        bs_write( s, 13, source->pid );
+        bs_write( s, 4, pkt[3] >> 4 );
+        bs_write( s, 4, (pkt[3] & 0x10) ? source->cc++ & 0xf : (source->cc - 1) & 0xf );
+        write_bytes( s, &pkt[4], TS_PACKET_SIZE - 4 );
+
+        /* a late packet lets the next one go early so the source can reach its cap */
+        if( source->max_bitrate )
+        {
+            int64_t interval = (int64_t)TS_PACKET_SIZE * 8 * TS_CLOCK / source->max_bitrate;
+            source->next_send = MAX( source->next_send, cur_pcr - interval ) + interval;
+        }
+
+        w->last_fill_source = idx;
+
+        if( increase_pcr( w, 1, 0 ) < 0 )
+            return -1;
+
+        return 1;
+    }
+
+    return 0;
+}
+
 static int check_bitstream( ts_writer_t *w )
 {
     if( w->out.bs.p_end - w->out.bs.p < 18800 )
@@ -895,16 +1623,52 @@ static void update_ts_params( ts_writer_t *w, ts_main_t *params )
 {
     w->ts_muxrate = params->muxrate;
     w->cbr = params->cbr;
+    w->vbr = params->vbr;
+    w->full_tstd = params->full_tstd;
     w->legacy_constraints = params->legacy_constraints;
     w->lowlatency = params->lowlatency;
+    w->lookahead = params->lookahead == LIBMPEGTS_NO_LOOKAHEAD ? 0 : params->lookahead ? params->lookahead : 1;
+    w->no_video_latency = params->no_video_latency;
+    w->mux_delay = params->mux_delay;
+    w->fast_channel_change = params->fast_channel_change;
+    w->shed_data_threshold = params->shed_data_threshold;
+    w->shed_video_threshold = params->shed_video_threshold;
+    w->reorder_window = params->reorder_window;
 
     w->pcr_period = params->pcr_period ? params->pcr_period : PCR_MAX_RETRANS_TIME;
     w->pat_period = params->pat_period ? params->pat_period : PAT_MAX_RETRANS_TIME;
     w->sdt_period = params->sdt_period ? params->sdt_period : SDT_MAX_RETRANS_TIME;
+    w->nit_period = params->nit_period ? params->nit_period : NIT_MAX_RETRANS_TIME;
+    w->tdt_period = params->tdt_period ? params->tdt_period : TDT_MAX_RETRANS_TIME;
 
     w->r_sys = MAX( R_SYS_DEFAULT, (double)w->ts_muxrate / 500 );
 }
 
+/* output buffers are allocated on first write so that setting up or cloning a writer is cheap */
+static int alloc_output_buffers( ts_writer_t *w )
+{
+    // FIXME realloc if necessary
+
+    w->out.i_bitstream = w->ts_muxrate >> 3;
+    w->out.p_bitstream = calloc( 1, w->out.i_bitstream );
+
+    if( !w->out.p_bitstream )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    w->pcr_list_alloced = 50000;
+    w->pcr_list = malloc( w->pcr_list_alloced * sizeof(int64_t) );
+    if( !w->pcr_list )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
 ts_writer_t *ts_create_writer( void )
 {
     ts_writer_t *w = calloc( 1, sizeof(*w) );
@@ -918,27 +1682,121 @@ ts_writer_t *ts_create_writer( void )
     return w;
 }
 
-int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
+/* create the internal context of an elementary stream */
+static ts_int_stream_t *create_stream( ts_writer_t *w, ts_stream_t *stream_in )
 {
-    // TODO check for PID collisions, add MPTS support
-    if( params->ts_type < TS_TYPE_GENERIC || params->ts_type > TS_TYPE_BLU_RAY )
+    ts_int_stream_t *cur_stream = calloc( 1, sizeof(*cur_stream) );
+    if( !cur_stream )
     {
-        fprintf( stderr, "Invalid Transport Stream type.\n" );
-        return -1;
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
     }
 
-    if( params->num_programs > 1 )
+    cur_stream->pid = stream_in->pid;
+    cur_stream->stream_format = stream_in->stream_format;
+    cur_stream->reorder_dts = INT64_MIN;
+    for( int j = 0; stream_type_table[j][0] != 0; j++ )
     {
-        fprintf( stderr, "Multiple program transport streams are not yet supported.\n" );
-        return -1;
+        if( cur_stream->stream_format == stream_type_table[j][0] )
+        {
+            /* DVB AC-3 and EAC-3 are different */
+            if( w->ts_type == TS_TYPE_DVB &&
+                ( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ) )
+                j++;
+
+            cur_stream->stream_type = stream_type_table[j][1];
+            break;
+        }
     }
 
-    if( !params->cbr && params->num_programs > 1 )
+    if( !cur_stream->stream_type )
     {
-        fprintf( stderr, "Multiple program transport streams cannot be variable bitrate.\n" );
-        return -1;
+        fprintf( stderr, "Unsupported Stream Format\n" );
+        free( cur_stream );
+        return NULL;
+    }
+
+    if( stream_in->write_lang_code )
+    {
+        cur_stream->write_lang_code = 1;
+        memcpy( cur_stream->lang_code, stream_in->lang_code, 4 );
+    }
+
+    cur_stream->audio_type = stream_in->audio_type;
+
+    cur_stream->stream_id = stream_in->stream_id;
+    /* Ignored in video streams  */
+    cur_stream->max_frame_size = stream_in->audio_frame_size;
+
+    if( stream_in->has_stream_identifier )
+    {
+        cur_stream->has_stream_identifier = 1;
+        cur_stream->stream_identifier = stream_in->stream_identifier & 0xff;
+    }
+
+    cur_stream->dvb_au = stream_in->dvb_au;
+    cur_stream->dvb_au_frame_rate = stream_in->dvb_au_frame_rate;
+
+    cur_stream->hdmv_frame_rate   = stream_in->hdmv_frame_rate;
+    cur_stream->hdmv_aspect_ratio = stream_in->hdmv_aspect_ratio;
+    cur_stream->hdmv_video_format = stream_in->hdmv_video_format;
+
+    if( stream_in->max_bitrate < 0 || stream_in->max_burst < 0 )
+    {
+        fprintf( stderr, "Invalid stream bitrate cap\n" );
+        free( cur_stream );
+        return NULL;
+    }
+
+    cur_stream->max_bitrate = stream_in->max_bitrate;
+    cur_stream->rate_b.buf_size = MAX( stream_in->max_burst, TS_PACKET_SIZE ) * 8;
+
+    cur_stream->tb.buf_size = TB_SIZE;
+
+    /* setup T-STD buffers when audio buffers sizes are independent of number of channels */
+    if( cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 || cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 ||
+        cur_stream->stream_format == LIBMPEGTS_AUDIO_OPUS )
+    {
+        /* use the defaults */
+        cur_stream->rx = MISC_AUDIO_RXN;
+        cur_stream->mb.buf_size = MISC_AUDIO_BS;
+    }
+    else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
+    {
+        cur_stream->rx = MISC_AUDIO_RXN;
+        cur_stream->mb.buf_size = w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ? AC3_BS_ATSC : AC3_BS_DVB;
+    }
+    else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_302M )
+    {
+        /* Use some made up value because (surprise surprise) SMPTE hasn't defined it properly
+         * 7 bytes in 24-bit packing * 4 pairs * 48000 * 1.2 */
+        cur_stream->rx = 7 * 4 * 48000 * 8 * 6 / 5;
+        cur_stream->mb.buf_size = SMPTE_302M_AUDIO_BS;
+    }
+    else if( cur_stream->stream_format == LIBMPEGTS_VIDEO_DIRAC )
+    {
+#define DIRAC_MAX_BITRATE 10000000
+        int bitrate = DIRAC_MAX_BITRATE * 1.2;
+        int bs_mux = 0.004 * bitrate;
+        int bs_oh = 1.0 * bitrate / 50.0;
+
+        cur_stream->mb.buf_size = bs_mux + bs_oh;
+        cur_stream->eb.buf_size = 10000000*8;
+
+        cur_stream->rx = bitrate;
+        cur_stream->rbx = bitrate;
+    }
+    else if( cur_stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
+    {
+        cur_stream->rx = 1.2 * 2500000;
     }
 
+    return cur_stream;
+}
+
+/* checks common to setting up and updating a transport stream */
+static int check_ts_params( ts_main_t *params )
+{
     if( params->network_pid && ( params->network_pid < 0x10 || params->network_pid == 0x1fff ) )
     {
         fprintf( stderr, "Invalid network_PID.\n" );
@@ -951,34 +1809,99 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
         return -1;
     }
 
-    BOOLIFY( params->cbr );
-    BOOLIFY( params->legacy_constraints );
-
-    int internal_pcr_pid, video_stream;
-    internal_pcr_pid = video_stream = 0;
-    ts_int_program_t *cur_program = calloc( 1, sizeof(*cur_program) );
-    if( !cur_program )
+    if( params->lookahead < LIBMPEGTS_NO_LOOKAHEAD )
     {
-        fprintf( stderr, "Malloc failed\n" );
+        fprintf( stderr, "Invalid lookahead\n" );
         return -1;
     }
 
-    w->ts_type = params->ts_type;
-    w->num_programs = 1;
-    w->programs[0] = cur_program;
+    if( params->no_video_latency < 0 )
+    {
+        fprintf( stderr, "Invalid latency budget\n" );
+        return -1;
+    }
 
-    cur_program->pmt.pid = params->programs[0].pmt_pid;
-    cur_program->program_num = params->programs[0].program_num;
+    if( params->mux_delay < 0 )
+    {
+        fprintf( stderr, "Invalid mux delay\n" );
+        return -1;
+    }
 
-    cur_program->is_3dtv = params->programs[0].is_3dtv;
-    cur_program->sb_leak_rate = params->programs[0].sb_leak_rate;
-    cur_program->sb_size = params->programs[0].sb_size;
-    cur_program->video_dts = -1;
+    if( params->shed_data_threshold < 0 || params->shed_video_threshold < 0 )
+    {
+        fprintf( stderr, "Invalid shedding threshold\n" );
+        return -1;
+    }
 
-    cur_program->sdt_ctx.service_type = params->programs[0].sdt.service_type;
-    if( params->programs[0].sdt.service_name )
+    if( params->reorder_window < 0 )
     {
-        cur_program->sdt_ctx.service_name = malloc( strlen( params->programs[0].sdt.service_name ) + 1 );
+        fprintf( stderr, "Invalid reorder window\n" );
+        return -1;
+    }
+
+    if( params->cbr && params->vbr )
+    {
+        fprintf( stderr, "CBR and VBR are mutually exclusive\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
+{
+    // TODO check for PID collisions, add MPTS support
+    if( params->ts_type < TS_TYPE_GENERIC || params->ts_type > TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "Invalid Transport Stream type.\n" );
+        return -1;
+    }
+
+    if( params->num_programs > 1 )
+    {
+        fprintf( stderr, "Multiple program transport streams are not yet supported.\n" );
+        return -1;
+    }
+
+    if( !params->cbr && params->num_programs > 1 )
+    {
+        fprintf( stderr, "Multiple program transport streams cannot be variable bitrate.\n" );
+        return -1;
+    }
+
+    if( check_ts_params( params ) < 0 )
+        return -1;
+
+    BOOLIFY( params->cbr );
+    BOOLIFY( params->vbr );
+    BOOLIFY( params->full_tstd );
+    BOOLIFY( params->legacy_constraints );
+
+    int internal_pcr_pid, video_stream;
+    internal_pcr_pid = video_stream = 0;
+    ts_int_program_t *cur_program = calloc( 1, sizeof(*cur_program) );
+    if( !cur_program )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    w->ts_type = params->ts_type;
+    w->num_programs = 1;
+    w->programs[0] = cur_program;
+
+    cur_program->pmt.pid = params->programs[0].pmt_pid;
+    cur_program->program_num = params->programs[0].program_num;
+
+    cur_program->is_3dtv = params->programs[0].is_3dtv;
+    cur_program->sb_leak_rate = params->programs[0].sb_leak_rate;
+    cur_program->sb_size = params->programs[0].sb_size;
+    cur_program->video_dts = -1;
+
+    cur_program->sdt_ctx.service_type = params->programs[0].sdt.service_type;
+    if( params->programs[0].sdt.service_name )
+    {
+        cur_program->sdt_ctx.service_name = malloc( strlen( params->programs[0].sdt.service_name ) + 1 );
         if( !cur_program->sdt_ctx.service_name )
         {
             fprintf( stderr, "Malloc failed\n" );
@@ -1012,43 +1935,9 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
             }
         }
 
-        ts_int_stream_t *cur_stream = calloc( 1, sizeof(*cur_stream) );
+        ts_int_stream_t *cur_stream = create_stream( w, stream_in );
         if( !cur_stream )
-        {
-            fprintf( stderr, "Malloc failed\n" );
-            return -1;
-        }
-
-        cur_stream->pid = stream_in->pid;
-        cur_stream->stream_format = stream_in->stream_format;
-        for( int j = 0; stream_type_table[j][0] != 0; j++ )
-        {
-            if( cur_stream->stream_format == stream_type_table[j][0] )
-            {
-                /* DVB AC-3 and EAC-3 are different */
-                if( w->ts_type == TS_TYPE_DVB &&
-                    ( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ) )
-                    j++;
-
-                cur_stream->stream_type = stream_type_table[j][1];
-                break;
-            }
-        }
-
-        if( !cur_stream->stream_type )
-        {
-            fprintf( stderr, "Unsupported Stream Format\n" );
-            free( cur_stream );
             return -1;
-        }
-
-        if( stream_in->write_lang_code )
-        {
-            cur_stream->write_lang_code = 1;
-            memcpy( cur_stream->lang_code, stream_in->lang_code, 4 );
-        }
-
-        cur_stream->audio_type = stream_in->audio_type;
 
         if( cur_stream->pid == params->programs[0].pcr_pid )
         {
@@ -1056,63 +1945,6 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
             internal_pcr_pid = 1;
         }
 
-        cur_stream->stream_id = stream_in->stream_id;
-        /* Ignored in video streams  */
-        cur_stream->max_frame_size = stream_in->audio_frame_size;
-
-        if( stream_in->has_stream_identifier )
-        {
-            cur_stream->has_stream_identifier = 1;
-            cur_stream->stream_identifier = stream_in->stream_identifier & 0xff;
-        }
-
-        cur_stream->dvb_au = stream_in->dvb_au;
-        cur_stream->dvb_au_frame_rate = stream_in->dvb_au_frame_rate;
-
-        cur_stream->hdmv_frame_rate   = stream_in->hdmv_frame_rate;
-        cur_stream->hdmv_aspect_ratio = stream_in->hdmv_aspect_ratio;
-        cur_stream->hdmv_video_format = stream_in->hdmv_video_format;
-
-        cur_stream->tb.buf_size = TB_SIZE;
-
-        /* setup T-STD buffers when audio buffers sizes are independent of number of channels */
-        if( cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 || cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 ||
-            cur_stream->stream_format == LIBMPEGTS_AUDIO_OPUS )
-        {
-            /* use the defaults */
-            cur_stream->rx = MISC_AUDIO_RXN;
-            cur_stream->mb.buf_size = MISC_AUDIO_BS;
-        }
-        else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
-        {
-            cur_stream->rx = MISC_AUDIO_RXN;
-            cur_stream->mb.buf_size = w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ? AC3_BS_ATSC : AC3_BS_DVB;
-        }
-        else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_302M )
-        {
-            /* Use some made up value because (surprise surprise) SMPTE hasn't defined it properly
-             * 7 bytes in 24-bit packing * 4 pairs * 48000 * 1.2 */
-            cur_stream->rx = 7 * 4 * 48000 * 8 * 6 / 5;
-            cur_stream->mb.buf_size = SMPTE_302M_AUDIO_BS;
-        }
-        else if( cur_stream->stream_format == LIBMPEGTS_VIDEO_DIRAC )
-        {
-#define DIRAC_MAX_BITRATE 10000000
-            int bitrate = DIRAC_MAX_BITRATE * 1.2;
-            int bs_mux = 0.004 * bitrate;
-            int bs_oh = 1.0 * bitrate / 50.0;
-
-            cur_stream->mb.buf_size = bs_mux + bs_oh;
-            cur_stream->eb.buf_size = 10000000*8;
-
-            cur_stream->rx = bitrate;
-            cur_stream->rbx = bitrate;
-        }
-        else if( cur_stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
-        {
-            cur_stream->rx = 1.2 * 2500000;
-        }
-
         cur_program->streams[cur_program->num_streams] = cur_stream;
         cur_program->num_streams++;
     }
@@ -1134,901 +1966,3574 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
     w->ts_id = params->ts_id;
     w->tb.buf_size = TB_SIZE;
     w->rx_sys = RX_SYS;
+    w->main_b.buf_size = SYS_BS;
 
     w->pcr_start = TS_START * TS_CLOCK;
+    w->pcr_clock = TS_CLOCK;
+    w->last_input_dts = INT64_MIN;
 
-    // FIXME realloc if necessary
-
-    w->out.i_bitstream = w->ts_muxrate >> 3;
-    w->out.p_bitstream = calloc( 1, w->out.i_bitstream );
-
-    if( !w->out.p_bitstream )
+    /* Although it is not in line with the mux strategy it is good practice to write PAT and PMT together */
+    if( !add_carousel( w, CAROUSEL_PAT, PAT_PID ) )
         return -1;
 
-    w->pcr_list_alloced = 50000;
-    w->pcr_list = malloc( w->pcr_list_alloced * sizeof(int64_t) );
-    if( !w->pcr_list )
-        return -1;
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_carousel_t *carousel = add_carousel( w, CAROUSEL_PMT, w->programs[i]->pmt.pid );
+        if( !carousel )
+            return -1;
+        carousel->program = i;
+    }
 
     return 0;
 }
 
-void ts_update_transport_stream( ts_writer_t *w, ts_main_t *params )
+/* signal a change to the streams of a program with a new PMT version, sent straight away */
+static void update_pmt( ts_writer_t *w, ts_int_program_t *program )
 {
-    int64_t cur_pcr = get_pcr_int( w, 0 );
-    if( params->muxrate != w->ts_muxrate )
+    program->pmt_version = (program->pmt_version + 1) & 0x1f;
+
+    for( int i = 0; i < w->num_carousels; i++ )
     {
-        update_ts_params( w, params );
-        w->packets_written = 0;
-        w->pcr_start = cur_pcr;
+        if( w->carousels[i].table == CAROUSEL_PMT && w->programs[w->carousels[i].program] == program )
+            w->carousels[i].next_send = 0;
     }
 }
 
-/* Codec-specific features */
-
-int ts_setup_mpegvideo_stream( ts_writer_t *w, int pid, int level, int profile, int vbv_maxrate, int vbv_bufsize, int frame_rate )
+static int pid_in_use( ts_writer_t *w, int pid )
 {
-    int bs_mux, bs_oh;
-    int level_idx = -1;
+    if( pid == w->network_pid || find_stream( w, pid ) || find_fill_source( w, pid ) )
+        return 1;
 
-    ts_int_stream_t *stream = find_stream( w, pid );
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        if( pid == w->programs[i]->pmt.pid )
+            return 1;
+    }
 
-    if( !stream )
+    for( int i = 0; i < w->num_carousels; i++ )
     {
-        fprintf( stderr, "Invalid PID\n" );
-        return -1;
+        if( pid == w->carousels[i].pid )
+            return 1;
     }
 
-    if( !( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC ) )
+    return 0;
+}
+
+/* a new version of a table is sent straight away */
+static void update_table_version( ts_writer_t *w, int table, int *version )
+{
+    *version = (*version + 1) & 0x1f;
+
+    for( int i = 0; i < w->num_carousels; i++ )
     {
-        fprintf( stderr, "PID is not an MPEG video stream\n" );
+        if( w->carousels[i].table == table )
+            w->carousels[i].next_send = 0;
+    }
+}
+
+/* copy a new SDT string, *dst stays NULL if it is unchanged */
+static int dup_changed_string( char **dst, char *cur, char *src )
+{
+    *dst = NULL;
+
+    if( !src || ( cur && !strcmp( cur, src ) ) )
+        return 0;
+
+    *dst = dup_mem( src, strlen( src ) + 1 );
+    if( !*dst )
+    {
+        fprintf( stderr, "Malloc failed\n" );
         return -1;
     }
 
-    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 )
+    return 0;
+}
+
+static void replace_string( char **dst, char *src, int *changed )
+{
+    if( !src )
+        return;
+
+    free( *dst );
+    *dst = src;
+    *changed = 1;
+}
+
+int ts_update_transport_stream( ts_writer_t *w, ts_main_t *params )
+{
+    ts_int_program_t *program = w->programs[0];
+    ts_int_carousel_t *nit = find_carousel( w, CAROUSEL_NIT, 0 );
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+    int network_id = params->network_id ? params->network_id : DEFAULT_NID;
+    int pat_changed, pmt_changed, sdt_changed, nit_changed;
+    char *service_name = NULL, *provider_name = NULL;
+
+    /* everything is checked and allocated before the writer is changed so a failed update leaves it as it was */
+    if( check_ts_params( params ) < 0 )
+        return -1;
+
+    if( params->network_pid != w->network_pid )
     {
-        if( level < LIBMPEGTS_MPEG2_LEVEL_LOW || level > LIBMPEGTS_MPEG2_LEVEL_HIGHP )
-        {
-            fprintf( stderr, "Invalid MPEG-2 Level\n" );
-            return -1;
-        }
-        if( profile < LIBMPEGTS_MPEG2_PROFILE_SIMPLE || profile > LIBMPEGTS_MPEG2_PROFILE_422 )
+        if( nit && !params->network_pid )
         {
-            fprintf( stderr, "Invalid MPEG-2 Profile\n" );
+            fprintf( stderr, "Remove the NIT before removing the network_PID\n" );
             return -1;
         }
 
-        for( int i = 0; mpeg2_levels[i].level != 0; i++ )
-            if( level == mpeg2_levels[i].level && profile == mpeg2_levels[i].profile )
-            {
-                level_idx = i;
-                break;
-            }
-
-        if( level_idx == -1 )
+        if( params->network_pid && pid_in_use( w, params->network_pid ) )
         {
-            fprintf( stderr, "Invalid MPEG-2 Level/Profile combination.\n" );
+            fprintf( stderr, "network_PID %i is already in use\n", params->network_pid );
             return -1;
         }
     }
-    else if( stream->stream_format == LIBMPEGTS_VIDEO_AVC )
-    {
-        for( int i = 0; avc_levels[i].level_idc != 0; i++ )
-            if( level == avc_levels[i].level_idc )
-            {
-                level_idx = i;
-                break;
-            }
 
-        if( level_idx == -1 )
-        {
-            fprintf( stderr, "Invalid AVC Level\n" );
-            return -1;
-        }
-        if( profile < AVC_BASELINE || profile > AVC_CAVLC_444_INTRA )
-        {
-            fprintf( stderr, "Invalid AVC Profile\n" );
+    /* the carousels are checked against the new rates and periods on a copy of the writer */
+    {
+        ts_writer_t new_w = *w;
+        update_ts_params( &new_w, params );
+        if( check_carousel_bitrate( &new_w ) < 0 )
             return -1;
-        }
     }
 
-    if( !stream->mpegvideo_ctx )
+    if( params->num_programs &&
+        ( dup_changed_string( &service_name, program->sdt_ctx.service_name, params->programs[0].sdt.service_name ) < 0 ||
+          dup_changed_string( &provider_name, program->sdt_ctx.provider_name, params->programs[0].sdt.provider_name ) < 0 ) )
     {
-        stream->mpegvideo_ctx = calloc( 1, sizeof(mpegvideo_stream_ctx_t) );
-        if( !stream->mpegvideo_ctx )
-        {
-            fprintf( stderr, "Malloc failed\n" );
-            return -1;
-        }
+        free( service_name );
+        return -1;
     }
 
-    stream->mpegvideo_ctx->level = level;
-    stream->mpegvideo_ctx->profile = profile;
+    pat_changed = params->ts_id != w->ts_id || params->network_pid != w->network_pid;
+    nit_changed = params->ts_id != w->ts_id || network_id != w->network_id;
+    sdt_changed = nit_changed;
+    pmt_changed = 0;
 
-    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 )
+    /* the PCR timeline is rebased at the current time so it carries on smoothly at the new rate */
+    if( params->muxrate != w->ts_muxrate )
     {
-        bs_mux = 0.004 * mpeg2_levels[level_idx].bitrate;
-        bs_oh = 1.0 * mpeg2_levels[level_idx].bitrate/750.0;
+        w->packets_written = 0;
+        w->pcr_start = cur_pcr;
+    }
 
-        stream->rx = 1.2 * mpeg2_levels[level_idx].bitrate;
-        stream->eb.buf_size = vbv_bufsize;
+    update_ts_params( w, params );
 
-        if( level == LIBMPEGTS_MPEG2_LEVEL_LOW || level == LIBMPEGTS_MPEG2_LEVEL_MAIN )
+    w->ts_id = params->ts_id;
+    w->network_id = network_id;
+    if( params->network_pid != w->network_pid )
+    {
+        w->network_pid = params->network_pid;
+        if( nit )
+            nit->pid = w->network_pid;
+    }
+
+    /* shorter periods take effect straight away */
+    for( int i = 0; i < w->num_carousels; i++ )
+        w->carousels[i].next_send = MIN( w->carousels[i].next_send, cur_pcr + carousel_period( w, &w->carousels[i] ) * 27000LL );
+
+    if( params->num_programs )
+    {
+        ts_program_t *program_in = &params->programs[0];
+
+        for( int i = 0; i < program_in->num_streams; i++ )
         {
-            stream->mb.buf_size = bs_mux + bs_oh + mpeg2_levels[level_idx].vbv - vbv_bufsize;
-            stream->rbx = mpeg2_levels[level_idx].bitrate;
+            ts_stream_t *stream_in = &program_in->streams[i];
+            ts_int_stream_t *stream = find_stream( w, stream_in->pid );
+
+            if( !stream )
+                continue;
+
+            if( !!stream_in->write_lang_code != stream->write_lang_code || stream_in->audio_type != stream->audio_type ||
+                ( stream_in->write_lang_code && memcmp( stream_in->lang_code, stream->lang_code, 4 ) ) )
+            {
+                stream->write_lang_code = !!stream_in->write_lang_code;
+                memcpy( stream->lang_code, stream_in->lang_code, 4 );
+                stream->audio_type = stream_in->audio_type;
+                pmt_changed = 1;
+            }
         }
-        else
+
+        if( program_in->sdt.service_type != program->sdt_ctx.service_type )
         {
-            stream->mb.buf_size = bs_mux + bs_oh;
-            stream->rbx = MIN( 1.05 * vbv_maxrate, mpeg2_levels[level_idx].bitrate );
+            program->sdt_ctx.service_type = program_in->sdt.service_type;
+            sdt_changed = 1;
         }
-    }
-    else if( stream->stream_format == LIBMPEGTS_VIDEO_AVC )
-    {
-        int factor = (float)nal_factor[stream->mpegvideo_ctx->profile] * 1.2;
-        int bitrate = avc_levels[level_idx].bitrate * factor;
-        bs_mux = 0.004 * MAX( bitrate, 2000000 );
-        bs_oh = 1.0 * MAX( bitrate, 2000000 )/750.0;
-
-        stream->mb.buf_size = bs_mux + bs_oh;
-        stream->eb.buf_size = avc_levels[level_idx].cpb * factor;
 
-        stream->rx = bitrate;
-        stream->rbx = bitrate;
+        replace_string( &program->sdt_ctx.service_name, service_name, &sdt_changed );
+        replace_string( &program->sdt_ctx.provider_name, provider_name, &sdt_changed );
     }
 
+    if( pat_changed )
+        update_table_version( w, CAROUSEL_PAT, &w->pat_version );
+    if( pmt_changed )
+        update_pmt( w, program );
+    if( sdt_changed )
+        update_table_version( w, CAROUSEL_SDT, &w->sdt_version );
+    if( nit_changed )
+        update_table_version( w, CAROUSEL_NIT, &w->nit_version );
+
     return 0;
 }
 
-int ts_setup_mpeg2_aac_stream( ts_writer_t *w, int pid, int profile, int channel_map )
+/* Writer templates */
+static char *dup_string( char *src )
 {
-    if( w->ts_type == TS_TYPE_BLU_RAY )
-    {
-        fprintf( stderr, "AAC not allowed in Blu-Ray\n" );
-        return -1;
-    }
-
-    ts_int_stream_t *stream = find_stream( w, pid );
+    return dup_mem( src, src ? strlen( src ) + 1 : 0 );
+}
 
-    if( !stream )
+static void reset_buffer( buffer_t *buffer )
+{
+    buffer->cur_buf = 0;
+    buffer->last_byte_removal_time = 0.0;
+}
+
+static void free_stream( ts_int_stream_t *stream )
+{
+    // TODO free other stuff
+    if( stream->mpegvideo_ctx )
+        free( stream->mpegvideo_ctx );
+    if( stream->lpcm_ctx )
+        free( stream->lpcm_ctx );
+    if( stream->atsc_ac3_ctx )
+        free( stream->atsc_ac3_ctx );
+    if( stream->dvb_sub_ctx )
+        free( stream->dvb_sub_ctx );
+    if( stream->dvb_ttx_ctx )
+        free( stream->dvb_ttx_ctx );
+    if( stream->dvb_vbi_ctx )
     {
-        fprintf( stderr, "Invalid PID\n" );
-        return -1;
+        for( int i = 0; i < stream->num_dvb_vbi; i++ )
+            free( stream->dvb_vbi_ctx[i].lines );
+        free( stream->dvb_vbi_ctx );
     }
+    free( stream->tstd_aus );
 
-    if( profile < 0 || profile > 1 )
+    free( stream );
+}
+
+int ts_set_clock_reference( ts_writer_t *w, int64_t ref_time )
+{
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+    int64_t pcr_clock;
+    double dt, error, target, max_step;
+
+    /* lock on the first call and relock if the reference jumps or goes backwards */
+    if( !w->clock_locked || ref_time < w->clock_last_ref ||
+        llabs( (cur_pcr - w->clock_pcr_start) - (ref_time - w->clock_ref_start) ) > TS_CLOCK )
     {
-        fprintf( stderr, "Invalid AAC profile\n" );
-        return -1;
+        w->clock_locked = 1;
+        w->clock_ref_start = w->clock_last_ref = ref_time;
+        w->clock_pcr_start = cur_pcr;
+        return 0;
     }
 
-    if( channel_map < 0 || channel_map > 7 )
+    dt = (double)(ref_time - w->clock_last_ref) / TS_CLOCK;
+    w->clock_last_ref = ref_time;
+
+    /* Aim to take up the error over CLOCK_LOCK_TIME, allowing for the error still to come while the frequency
+     * offset is brought back down at the maximum rate of change so the loop does not overshoot */
+    error = (cur_pcr - w->clock_pcr_start) - (ref_time - w->clock_ref_start);
+    error += w->clock_offset * fabs( w->clock_offset ) / (2 * PCR_MAX_SLEW_RATE);
+    target = MIN( MAX( -error / CLOCK_LOCK_TIME, -PCR_MAX_FREQ_OFFSET ), PCR_MAX_FREQ_OFFSET );
+    max_step = PCR_MAX_SLEW_RATE * dt;
+    w->clock_offset += MIN( MAX( target - w->clock_offset, -max_step ), max_step );
+
+    pcr_clock = TS_CLOCK + llround( w->clock_offset );
+    if( pcr_clock != w->pcr_clock )
     {
-        fprintf( stderr, "Invalid AAC channel map\n" );
-        return -1;
+        /* rebase the PCR timeline so it carries on smoothly at the new frequency */
+        w->packets_written = 0;
+        w->pcr_start = cur_pcr;
+        w->pcr_clock = pcr_clock;
     }
 
-    stream->aac_profile = profile;
-    stream->aac_is_mpeg4    = 0;
-    stream->aac_channel_map = channel_map;
+    return 0;
+}
 
-    /* channel map index is pretty much correct so there's no point in writing a LUT */
-    int num_channels = channel_map == LIBMPEGTS_MPEG2_AAC_5_POINT_1_CHANNEL ? 5 : channel_map;
+/* copy the configuration of a stream and reset its mutable state */
+static ts_int_stream_t *clone_stream( ts_int_stream_t *src )
+{
+    ts_int_stream_t *stream = dup_mem( src, sizeof(*src) );
+    if( !stream )
+        return NULL;
 
-    for( int i = 0; aac_buffers[i].max_channels != 0; i++ )
+    stream->cc = 0;
+    stream->last_pkt_pcr = 0;
+    reset_buffer( &stream->tb );
+    reset_buffer( &stream->mb );
+    reset_buffer( &stream->eb );
+    reset_buffer( &stream->rate_b );
+    stream->splice_pending = stream->splice_point_flag = 0;
+    stream->reorder_dts = INT64_MIN;
+    stream->num_tstd_aus = stream->tstd_aus_alloced = 0;
+    stream->tstd_aus = NULL;
+    stream->mb_discard = 0;
+
+    stream->mpegvideo_ctx = NULL;
+    stream->lpcm_ctx = NULL;
+    stream->atsc_ac3_ctx = NULL;
+    stream->dvb_sub_ctx = NULL;
+    stream->dvb_ttx_ctx = NULL;
+    stream->dvb_vbi_ctx = NULL;
+    stream->num_dvb_vbi = 0;
+
+    if( ( src->mpegvideo_ctx && !( stream->mpegvideo_ctx = dup_mem( src->mpegvideo_ctx, sizeof(*src->mpegvideo_ctx) ) ) ) ||
+        ( src->lpcm_ctx && !( stream->lpcm_ctx = dup_mem( src->lpcm_ctx, sizeof(*src->lpcm_ctx) ) ) ) ||
+        ( src->atsc_ac3_ctx && !( stream->atsc_ac3_ctx = dup_mem( src->atsc_ac3_ctx, sizeof(*src->atsc_ac3_ctx) ) ) ) ||
+        ( src->dvb_sub_ctx && !( stream->dvb_sub_ctx = dup_mem( src->dvb_sub_ctx, src->num_dvb_sub * sizeof(ts_dvb_sub_t) ) ) ) ||
+        ( src->dvb_ttx_ctx && !( stream->dvb_ttx_ctx = dup_mem( src->dvb_ttx_ctx, src->num_dvb_ttx * sizeof(ts_dvb_ttx_t) ) ) ) )
+        goto fail;
+
+    if( src->dvb_vbi_ctx )
     {
-        if( num_channels <= aac_buffers[i].max_channels )
+        stream->dvb_vbi_ctx = calloc( src->num_dvb_vbi, sizeof(ts_dvb_vbi_t) );
+        if( !stream->dvb_vbi_ctx )
+            goto fail;
+
+        for( int i = 0; i < src->num_dvb_vbi; i++ )
         {
-            stream->rx = aac_buffers[i].rxn;
-            stream->mb.buf_size = aac_buffers[i].bsn;
+            stream->dvb_vbi_ctx[i] = src->dvb_vbi_ctx[i];
+            stream->dvb_vbi_ctx[i].lines = dup_mem( src->dvb_vbi_ctx[i].lines, src->dvb_vbi_ctx[i].num_lines * sizeof(ts_dvb_vbi_line_t) );
+            stream->num_dvb_vbi++;
+            if( !stream->dvb_vbi_ctx[i].lines )
+                goto fail;
         }
     }
-    return 0;
+
+    return stream;
+
+fail:
+    free_stream( stream );
+    return NULL;
 }
 
-int ts_setup_mpeg4_aac_stream( ts_writer_t *w, int pid, int profile_and_level, int num_channels )
+static ts_int_program_t *clone_program( ts_int_program_t *src )
 {
-    if( w->ts_type == TS_TYPE_BLU_RAY )
+    ts_int_program_t *program = dup_mem( src, sizeof(*src) );
+    if( !program )
+        return NULL;
+
+    program->pmt.cc = 0;
+    program->last_pcr = 0;
+    program->video_dts = -1;
+    program->num_streams = 0;
+    program->pcr_stream = NULL;
+    program->sdt_ctx.service_name = dup_string( src->sdt_ctx.service_name );
+    program->sdt_ctx.provider_name = dup_string( src->sdt_ctx.provider_name );
+
+    for( int i = 0; i < src->num_streams; i++ )
     {
-        fprintf( stderr, "AAC not allowed in Blu-Ray\n" );
-        return -1;
+        program->streams[i] = clone_stream( src->streams[i] );
+        if( !program->streams[i] )
+            return program;
+        program->num_streams++;
+
+        if( src->pcr_stream == src->streams[i] )
+            program->pcr_stream = program->streams[i];
     }
 
-    if( profile_and_level <= 0 )
+    /* separate PCR PID */
+    if( !program->pcr_stream )
+        program->pcr_stream = clone_stream( src->pcr_stream );
+
+    return program;
+}
+
+ts_writer_t *ts_clone_writer( ts_writer_t *src )
+{
+    ts_writer_t *w = dup_mem( src, sizeof(*src) );
+    ts_int_stream_t **tables[] = { &w->nit, &w->sdt, &w->eit, &w->tdt, &w->sit };
+    int fail = 0;
+
+    if( !w )
     {
-        fprintf( stderr, "Invalid Profile and Level value\n" );
-        return -1;
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
     }
 
-    if( num_channels <= 0 || num_channels > 48 )
+    /* mutable state starts afresh, output buffers are allocated on first write */
+    memset( &w->out, 0, sizeof(w->out) );
+    w->bytes_written = w->packets_written = 0;
+    w->pcr_start = TS_START * TS_CLOCK;
+    w->pcr_clock = TS_CLOCK;
+    w->last_input_dts = INT64_MIN;
+    w->clock_locked = 0;
+    w->clock_offset = 0;
+    w->pat_cc = 0;
+    w->first_input = 0;
+    w->late_packets = w->shed_data_frames = w->shed_video_frames = w->shed_bytes = w->reorder_late_frames = 0;
+    w->queue_margin = 0;
+    w->margin_alloced = 0;
+    w->margin_frames = NULL;
+    w->margin_bytes = NULL;
+    w->num_buffered_frames = w->num_prev_buffered_frames = 0;
+    w->buffered_frames = NULL;
+    w->num_reorder_frames = w->reorder_frames_alloced = 0;
+    w->reorder_frames = NULL;
+    w->reorder_input_times = NULL;
+    w->num_splice_sections = 0;
+    w->splice_sections = NULL;
+    w->num_pcrs = w->pcr_list_alloced = 0;
+    w->pcr_list = NULL;
+    w->state_size = w->state_alloced = 0;
+    w->state = NULL;
+    reset_buffer( &w->tb );
+    reset_buffer( &w->main_b );
+    reset_buffer( &w->si_b );
+    memset( &w->system_queue, 0, sizeof(w->system_queue) );
+    memset( &w->si_queue, 0, sizeof(w->si_queue) );
+    w->fcc_psi_left = 0;
+
+    w->carousels = dup_mem( src->carousels, src->num_carousels * sizeof(*src->carousels) );
+    if( src->num_carousels && !w->carousels )
     {
-        fprintf( stderr, "Invalid number of channels\n" );
-        return -1;
+        w->num_carousels = 0;
+        fail = 1;
     }
-
-    ts_int_stream_t *stream = find_stream( w, pid );
-
-    if( !stream )
+    for( int i = 0; i < w->num_carousels; i++ )
     {
-        fprintf( stderr, "Invalid PID\n" );
-        return -1;
+        ts_int_carousel_t *carousel = &w->carousels[i];
+        carousel->cc = 0;
+        carousel->next_send = carousel->queued_until = 0;
+        carousel->num_sections = 0;
+        if( carousel->table == CAROUSEL_SECTIONS &&
+            copy_sections( carousel, src->carousels[i].num_sections, src->carousels[i].sections, src->carousels[i].section_lengths ) < 0 )
+            fail = 1;
     }
 
-    stream->aac_profile = profile_and_level;
-    stream->aac_is_mpeg4    = 1;
+    /* fill sources are copied without their queued packets */
+    w->fill_sources = dup_mem( src->fill_sources, src->num_fill_sources * sizeof(*src->fill_sources) );
+    if( src->num_fill_sources && !w->fill_sources )
+    {
+        w->num_fill_sources = 0;
+        fail = 1;
+    }
+    w->last_fill_source = 0;
+    for( int i = 0; i < w->num_fill_sources; i++ )
+    {
+        ts_int_fill_source_t *source = &w->fill_sources[i];
+        source->cc = 0;
+        source->next_send = 0;
+        source->read_pos = source->num_packets = source->packets_alloced = 0;
+        source->packets = NULL;
+    }
 
-    for( int i = 0; aac_buffers[i].max_channels != 0; i++ )
+    w->num_programs = 0;
+    for( int i = 0; i < src->num_programs; i++ )
     {
-        if( num_channels <= aac_buffers[i].max_channels )
+        w->programs[i] = clone_program( src->programs[i] );
+        if( !w->programs[i] )
         {
-            stream->rx = aac_buffers[i].rxn;
-            stream->mb.buf_size = aac_buffers[i].bsn;
+            fail = 1;
+            break;
+        }
+        w->num_programs++;
+
+        if( w->programs[i]->num_streams != src->programs[i]->num_streams || !w->programs[i]->pcr_stream ||
+            ( src->programs[i]->sdt_ctx.service_name && !w->programs[i]->sdt_ctx.service_name ) ||
+            ( src->programs[i]->sdt_ctx.provider_name && !w->programs[i]->sdt_ctx.provider_name ) )
+        {
+            fail = 1;
+            break;
         }
     }
 
-    return 0;
-};
+    for( int i = 0; i < sizeof(tables) / sizeof(tables[0]); i++ )
+    {
+        ts_int_stream_t *table = *tables[i];
+        *tables[i] = NULL;
+        if( !fail && table )
+        {
+            *tables[i] = clone_stream( table );
+            fail |= !*tables[i];
+        }
+    }
 
-int ts_setup_opus_stream( ts_writer_t *w, int pid, int channel_map )
-{
-    ts_int_stream_t *stream = find_stream( w, pid );
+    w->dtcp_ctx = NULL;
+    if( !fail && src->dtcp_ctx )
+    {
+        w->dtcp_ctx = dup_mem( src->dtcp_ctx, sizeof(*src->dtcp_ctx) );
+        fail |= !w->dtcp_ctx;
+    }
 
-    if( !stream )
+    if( fail )
     {
-        fprintf( stderr, "Invalid PID\n" );
-        return -1;
+        fprintf( stderr, "Malloc failed\n" );
+        ts_close_writer( w );
+        return NULL;
     }
 
-    stream->opus_channel_map = channel_map;
+    return w;
+}
 
-    return 0;
+/* wall clock in microseconds, for the frame completion callback */
+static int64_t get_wall_clock( void )
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    if( !QueryPerformanceFrequency( &freq ) || !QueryPerformanceCounter( &count ) )
+        return 0;
+
+    return count.QuadPart / freq.QuadPart * 1000000 + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if( clock_gettime( CLOCK_MONOTONIC, &ts ) < 0 )
+        return 0;
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+
+    if( gettimeofday( &tv, NULL ) < 0 )
+        return 0;
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
 }
 
-int ts_setup_dvb_subtitles( ts_writer_t *w, int pid, int has_dds, int num_subtitles, ts_dvb_sub_t *subtitles )
+/* the clock is only read while there is a callback to report to, frames passed in before it was set have no input time */
+static int64_t get_input_time( ts_writer_t *w )
 {
-    if( w->ts_type == TS_TYPE_BLU_RAY )
+    return w->frame_done ? get_wall_clock() : 0;
+}
+
+static int64_t get_queue_time( int64_t input_time )
+{
+    return input_time ? get_wall_clock() - input_time : 0;
+}
+
+/* tell the application that a frame leaves the writer without being written completely */
+static void frame_dropped( ts_writer_t *w, int pid, void *opaque, int64_t first_pcr, int64_t input_time )
+{
+    if( w->frame_done && !w->simulate )
     {
-        fprintf( stderr, "DVB Subtitles not allowed in Blu-Ray\n" );
-        return -1;
+        ts_frame_done_t done = { pid, opaque, first_pcr, -1, get_queue_time( input_time ), 1 };
+        w->frame_done( w->frame_done_priv, &done );
     }
+}
 
-    ts_int_stream_t *stream = find_stream( w, pid );
+static void pes_dropped( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    frame_dropped( w, pes->stream->pid, pes->opaque, pes->cur_pos != pes->data ? pes->first_pcr : -1, pes->input_time );
+}
 
-    if( !stream )
+static int alloc_reorder_frames( ts_writer_t *w, int alloced )
+{
+    ts_frame_t *frames = realloc( w->reorder_frames, alloced * sizeof(*w->reorder_frames) );
+    if( frames )
+        w->reorder_frames = frames;
+
+    int64_t *input_times = realloc( w->reorder_input_times, alloced * sizeof(*w->reorder_input_times) );
+    if( input_times )
+        w->reorder_input_times = input_times;
+
+    if( !frames || !input_times )
     {
-        fprintf( stderr, "Invalid PID\n" );
+        fprintf( stderr, "Malloc failed\n" );
         return -1;
     }
+    w->reorder_frames_alloced = alloced;
 
-    if( !subtitles || !num_subtitles )
+    return 0;
+}
+
+/* Writer state checkpoints
+ * Integers are big-endian so that a checkpoint can be restored on another machine */
+#define STATE_MAGIC   0x54535354 /* "TSST" */
+#define STATE_VERSION 12
+
+static void write_state_int( ts_writer_t *w, int64_t val, int bytes )
+{
+    if( w->state_size < 0 )
+        return;
+
+    if( w->state_size + bytes > w->state_alloced )
     {
-        fprintf( stderr, "Invalid Number of subtitles\n" );
-        return -1;
+        int alloced = MAX( w->state_alloced * 2, 4096 );
+        uint8_t *tmp = realloc( w->state, alloced );
+        if( !tmp )
+        {
+            w->state_size = -1;
+            return;
+        }
+        w->state = tmp;
+        w->state_alloced = alloced;
     }
 
-    if( stream->dvb_sub_ctx )
-        free( stream->dvb_sub_ctx );
+    for( int i = bytes - 1; i >= 0; i-- )
+        w->state[w->state_size++] = (uint64_t)val >> (8*i);
+}
 
-    stream->dvb_sub_ctx = calloc( 1, num_subtitles * sizeof(ts_dvb_sub_t) );
-    if( !stream->dvb_sub_ctx )
-        return -1;
+static void write_state_bytes( ts_writer_t *w, uint8_t *bytes, int length )
+{
+    for( int i = 0; i < length; i++ )
+        write_state_int( w, bytes[i], 1 );
+}
 
-    stream->num_dvb_sub = num_subtitles;
-    memcpy( stream->dvb_sub_ctx, subtitles, num_subtitles * sizeof(ts_dvb_sub_t) );
+static void write_state_buffer( ts_writer_t *w, buffer_t *buffer )
+{
+    uint64_t time;
 
-    /* Display Definition Segment has different buffer sizes */
-    if( has_dds )
+    memcpy( &time, &buffer->last_byte_removal_time, sizeof(time) );
+    write_state_int( w, buffer->cur_buf, 4 );
+    write_state_int( w, time, 8 );
+}
+
+/* a truncated checkpoint sets *p to NULL */
+static int64_t read_state_int( uint8_t **p, uint8_t *end, int bytes )
+{
+    uint64_t val = 0;
+
+    if( !*p || end - *p < bytes )
     {
-        stream->tb.buf_size = DVB_SUB_DDS_TB_SIZE;
-        stream->rx = DVB_SUB_DDS_RXN;
-        stream->mb.buf_size = DVB_SUB_DDS_MB_SIZE;
+        *p = NULL;
+        return 0;
     }
-    else
+
+    for( int i = 0; i < bytes; i++ )
+        val = (val << 8) | *(*p)++;
+
+    /* sign extend */
+    if( bytes < 8 && ( val >> (8*bytes - 1) ) )
+        val |= ~0ULL << (8*bytes);
+
+    return (int64_t)val;
+}
+
+static uint8_t *read_state_bytes( uint8_t **p, uint8_t *end, int length )
+{
+    uint8_t *bytes = *p;
+
+    if( !*p || length < 0 || end - *p < length )
     {
-        stream->rx = DVB_SUB_RXN;
-        stream->mb.buf_size = DVB_SUB_MB_SIZE;
+        *p = NULL;
+        return NULL;
     }
 
-    return 0;
+    *p += length;
+
+    return bytes;
 }
 
-int ts_setup_dvb_teletext( ts_writer_t *w, int pid, int num_teletexts, ts_dvb_ttx_t *teletexts )
+static void read_state_buffer( uint8_t **p, uint8_t *end, buffer_t *buffer, int apply )
 {
-    if( w->ts_type == TS_TYPE_BLU_RAY )
+    int cur_buf = read_state_int( p, end, 4 );
+    uint64_t time = read_state_int( p, end, 8 );
+
+    if( apply )
     {
-        fprintf( stderr, "Teletext not allowed in Blu-Ray\n" );
-        return -1;
+        buffer->cur_buf = cur_buf;
+        memcpy( &buffer->last_byte_removal_time, &time, sizeof(time) );
     }
+}
 
-    ts_int_stream_t *stream = find_stream( w, pid );
+static void write_state_psi_queue( ts_writer_t *w, ts_int_psi_queue_t *queue )
+{
+    write_state_int( w, psi_queued( queue ), 4 );
+    write_state_int( w, queue->tail_used, 4 );
+    write_state_int( w, queue->num_sent, 8 );
+    write_state_bytes( w, &queue->packets[queue->read_pos * TS_PACKET_SIZE], psi_queued( queue ) * TS_PACKET_SIZE );
+}
 
-    if( !stream )
+static int read_state_psi_queue( uint8_t **p, uint8_t *end, ts_int_psi_queue_t *queue, int apply )
+{
+    int num = read_state_int( p, end, 4 );
+    int tail_used = read_state_int( p, end, 4 );
+    int64_t num_sent = read_state_int( p, end, 8 );
+    uint8_t *packets;
+
+    if( *p && ( num < 0 || num > INT_MAX / TS_PACKET_SIZE ) )
     {
-        fprintf( stderr, "Invalid PID\n" );
+        fprintf( stderr, "Invalid saved state\n" );
         return -1;
     }
+    packets = read_state_bytes( p, end, num * TS_PACKET_SIZE );
 
-    if( !teletexts || !num_teletexts )
+    if( apply && num > queue->packets_alloced )
     {
-        fprintf( stderr, "Invalid Number of teletexts\n" );
-        return -1;
+        uint8_t *tmp = realloc( queue->packets, num * TS_PACKET_SIZE );
+        if( !tmp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        queue->packets = tmp;
+        queue->packets_alloced = num;
     }
 
-    if( stream->dvb_ttx_ctx )
-        free( stream->dvb_ttx_ctx );
-
-    stream->dvb_ttx_ctx = calloc( 1, num_teletexts * sizeof(ts_dvb_ttx_t) );
-    if( !stream->dvb_ttx_ctx )
-        return -1;
-
-    stream->num_dvb_ttx = num_teletexts;
-    memcpy( stream->dvb_ttx_ctx, teletexts, num_teletexts * sizeof(ts_dvb_ttx_t) );
-
-    stream->tb.buf_size = TELETEXT_T_BS;
-    stream->rx = TELETEXT_RXN;
-    stream->mb.buf_size = TELETEXT_BTTX;
+    if( apply )
+    {
+        memcpy( queue->packets, packets, num * TS_PACKET_SIZE );
+        queue->read_pos = 0;
+        queue->num_packets = num;
+        queue->tail_used = tail_used;
+        queue->num_sent = num_sent;
+    }
 
     return 0;
 }
 
-int ts_setup_dvb_vbi( ts_writer_t *w, int pid, int num_vbis, ts_dvb_vbi_t *vbis )
+static void write_stream_state( ts_writer_t *w, ts_int_stream_t *stream )
 {
-    if( w->ts_type == TS_TYPE_BLU_RAY )
+    write_state_int( w, stream->pid, 2 );
+    write_state_int( w, stream->cc, 1 );
+    write_state_int( w, stream->last_pkt_pcr, 8 );
+    write_state_buffer( w, &stream->tb );
+    write_state_buffer( w, &stream->mb );
+    write_state_buffer( w, &stream->eb );
+    write_state_buffer( w, &stream->rate_b );
+
+    write_state_int( w, stream->splice_pending | stream->splice_seamless << 1 | stream->splice_ltw << 2 |
+                     stream->splice_piecewise_rate << 3 | stream->splice_point_flag << 4, 1 );
+    write_state_int( w, stream->splice_type, 1 );
+    write_state_int( w, stream->splice_pts, 8 );
+    write_state_int( w, stream->splice_dts_next_au, 8 );
+    write_state_int( w, stream->reorder_dts, 8 );
+
+    write_state_int( w, stream->mb_discard, 4 );
+    write_state_int( w, stream->num_tstd_aus, 4 );
+    for( int i = 0; i < stream->num_tstd_aus; i++ )
     {
-        fprintf( stderr, "VBI not allowed in Blu-Ray\n" );
-        return -1;
+        write_state_int( w, stream->tstd_aus[i].dts, 8 );
+        write_state_int( w, stream->tstd_aus[i].size, 4 );
     }
+}
 
+static int read_stream_state( ts_writer_t *w, uint8_t **p, uint8_t *end, int apply )
+{
+    int pid = read_state_int( p, end, 2 );
+    int cc = read_state_int( p, end, 1 );
+    int64_t last_pkt_pcr = read_state_int( p, end, 8 );
     ts_int_stream_t *stream = find_stream( w, pid );
+    buffer_t dummy;
+    int mb_discard, num_aus;
+
+    if( !*p )
+        return -1;
 
     if( !stream )
     {
-        fprintf( stderr, "Invalid PID\n" );
+        fprintf( stderr, "PID %i in saved state not found\n", pid );
         return -1;
     }
 
-    if( !vbis || !num_vbis )
+    if( !apply )
+        stream = NULL;
+
+    read_state_buffer( p, end, stream ? &stream->tb : &dummy, apply );
+    read_state_buffer( p, end, stream ? &stream->mb : &dummy, apply );
+    read_state_buffer( p, end, stream ? &stream->eb : &dummy, apply );
+    read_state_buffer( p, end, stream ? &stream->rate_b : &dummy, apply );
+
+    int splice_flags = read_state_int( p, end, 1 );
+    int splice_type = read_state_int( p, end, 1 );
+    int64_t splice_pts = read_state_int( p, end, 8 );
+    int64_t splice_dts_next_au = read_state_int( p, end, 8 );
+    int64_t reorder_dts = read_state_int( p, end, 8 );
+    if( stream )
     {
-        fprintf( stderr, "Invalid Number of VBI services\n" );
-        return -1;
+        stream->splice_pending = splice_flags & 1;
+        stream->splice_seamless = (splice_flags >> 1) & 1;
+        stream->splice_ltw = (splice_flags >> 2) & 1;
+        stream->splice_piecewise_rate = (splice_flags >> 3) & 1;
+        stream->splice_point_flag = (splice_flags >> 4) & 1;
+        stream->splice_type = splice_type & 0xf;
+        stream->splice_pts = splice_pts;
+        stream->splice_dts_next_au = splice_dts_next_au;
+        stream->reorder_dts = reorder_dts;
     }
 
-    if( stream->dvb_vbi_ctx )
-        free( stream->dvb_vbi_ctx );
-
-    stream->dvb_vbi_ctx = calloc( 1, num_vbis * sizeof(ts_dvb_vbi_t) );
-    if( !stream->dvb_vbi_ctx )
+    mb_discard = read_state_int( p, end, 4 );
+    num_aus = read_state_int( p, end, 4 );
+    if( !*p || mb_discard < 0 || num_aus < 0 || end - *p < (int64_t)num_aus * 12 )
+    {
+        *p = NULL;
         return -1;
+    }
 
-    stream->num_dvb_vbi = num_vbis;
-    memcpy( stream->dvb_vbi_ctx, vbis, num_vbis * sizeof(ts_dvb_vbi_t) );
-
-    for( int i = 0; i < stream->num_dvb_vbi; i++ )
+    if( stream )
     {
-        stream->dvb_vbi_ctx[i].lines = calloc( 1, vbis[i].num_lines * sizeof(ts_dvb_vbi_line_t) );
-        if( !stream->dvb_vbi_ctx[i].lines )
-        {
-            fprintf( stderr, "Malloc failed\n" );
+        stream->cc = cc;
+        stream->last_pkt_pcr = last_pkt_pcr;
+        stream->mb_discard = mb_discard;
 
-            for( int j = 0; i < stream->num_dvb_vbi; j++ )
+        if( num_aus > stream->tstd_aus_alloced )
+        {
+            tstd_au_t *tmp = realloc( stream->tstd_aus, num_aus * sizeof(*stream->tstd_aus) );
+            if( !tmp )
             {
-                if( stream->dvb_vbi_ctx[j].lines )
-                    free( stream->dvb_vbi_ctx[j].lines );
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
             }
-
-            free( stream->dvb_vbi_ctx );
-
-            return -1;
+            stream->tstd_aus = tmp;
+            stream->tstd_aus_alloced = num_aus;
         }
-        memcpy( stream->dvb_vbi_ctx[i].lines, vbis[i].lines, vbis[i].num_lines * sizeof(ts_dvb_vbi_line_t) );
+        stream->num_tstd_aus = num_aus;
     }
 
-    if( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC )
-    {
-        stream->rx = SCTE_VBI_RXN;
-        stream->mb.buf_size = SCTE_VBI_MB_SIZE;
-    }
-    else
+    for( int i = 0; i < num_aus; i++ )
     {
-        /* DVB-VBI uses teletext T-STD */
-        stream->tb.buf_size = TELETEXT_T_BS;
-        stream->rx = TELETEXT_RXN;
-        stream->mb.buf_size = TELETEXT_BTTX;
+        int64_t dts = read_state_int( p, end, 8 );
+        int size = read_state_int( p, end, 4 );
+        if( stream )
+        {
+            stream->tstd_aus[i].dts = dts;
+            stream->tstd_aus[i].size = size;
+        }
     }
 
     return 0;
 }
 
-int ts_setup_sdt( ts_writer_t *w )
+int ts_save_state( ts_writer_t *w, uint8_t **state, int *size )
 {
-    w->sdt = calloc( 1, sizeof(*w->sdt) );
-    if( !w->sdt )
+    ts_int_stream_t *tables[] = { w->nit, w->sdt, w->eit, w->tdt, w->sit };
+
+    w->state_size = 0;
+
+    write_state_int( w, STATE_MAGIC, 4 );
+    write_state_int( w, STATE_VERSION, 1 );
+    write_state_int( w, w->ts_muxrate, 4 );
+
+    write_state_int( w, w->bytes_written, 8 );
+    write_state_int( w, w->packets_written, 8 );
+    write_state_int( w, w->pcr_start, 8 );
+    write_state_int( w, w->last_input_dts, 8 );
+    write_state_int( w, w->pcr_clock, 8 );
+    write_state_int( w, w->clock_locked, 1 );
+    write_state_int( w, w->clock_ref_start, 8 );
+    write_state_int( w, w->clock_pcr_start, 8 );
+    write_state_int( w, w->clock_last_ref, 8 );
     {
-        fprintf( stderr, "malloc failed\n" );
+        uint64_t offset;
+        memcpy( &offset, &w->clock_offset, sizeof(offset) );
+        write_state_int( w, offset, 8 );
+    }
+    write_state_int( w, w->late_packets, 8 );
+    write_state_int( w, w->shed_data_frames, 8 );
+    write_state_int( w, w->shed_video_frames, 8 );
+    write_state_int( w, w->shed_bytes, 8 );
+    write_state_int( w, w->reorder_late_frames, 8 );
+    write_state_int( w, w->first_input, 1 );
+    write_state_int( w, w->pat_cc, 1 );
+    write_state_int( w, w->pat_version, 1 );
+    write_state_int( w, w->sdt_version, 1 );
+    write_state_int( w, w->nit_version, 1 );
+    write_state_buffer( w, &w->tb );
+    write_state_buffer( w, &w->main_b );
+    write_state_buffer( w, &w->si_b );
+
+    for( int i = 0; i < sizeof(tables) / sizeof(tables[0]); i++ )
+        write_state_int( w, tables[i] ? tables[i]->cc : -1, 1 );
+
+    write_state_psi_queue( w, &w->system_queue );
+    write_state_psi_queue( w, &w->si_queue );
+    write_state_int( w, w->fcc_psi_left, 4 );
+
+    write_state_int( w, w->num_carousels, 4 );
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        ts_int_carousel_t *carousel = &w->carousels[i];
+        write_state_int( w, carousel->table, 1 );
+        write_state_int( w, carousel->id, 4 );
+        write_state_int( w, carousel->pid, 2 );
+        write_state_int( w, carousel->cc, 1 );
+        write_state_int( w, carousel->num_packets, 4 );
+        write_state_int( w, carousel->next_send, 8 );
+        write_state_int( w, carousel->queued_until, 8 );
+    }
+
+    write_state_int( w, w->num_fill_sources, 4 );
+    for( int i = 0; i < w->num_fill_sources; i++ )
+    {
+        write_state_int( w, w->fill_sources[i].pid, 2 );
+        write_state_int( w, w->fill_sources[i].cc, 1 );
+        write_state_int( w, w->fill_sources[i].next_send, 8 );
+    }
+
+    write_state_int( w, w->num_programs, 4 );
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
+        write_state_int( w, program->pmt.cc, 1 );
+        write_state_int( w, program->pmt_version, 1 );
+        write_state_int( w, program->last_pcr, 8 );
+        write_state_int( w, program->video_dts, 8 );
+        write_state_int( w, program->pcr_stream->cc, 1 );
+
+        write_state_int( w, program->num_streams, 4 );
+        for( int j = 0; j < program->num_streams; j++ )
+            write_stream_state( w, program->streams[j] );
+    }
+
+    write_state_int( w, w->num_buffered_frames, 4 );
+    write_state_int( w, w->num_prev_buffered_frames, 4 );
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->buffered_frames[i];
+        write_state_int( w, pes->stream->pid, 2 );
+        write_state_int( w, pes->size, 4 );
+        write_state_int( w, pes->cur_pos - pes->data, 4 );
+        write_state_int( w, pes->bytes_left, 4 );
+        write_state_int( w, pes->complete, 1 );
+        write_state_int( w, pes->header_size, 4 );
+        write_state_int( w, pes->random_access, 1 );
+        write_state_int( w, pes->priority, 1 );
+        write_state_int( w, pes->fcc_psi_sent, 1 );
+        write_state_int( w, pes->initial_arrival_time, 8 );
+        write_state_int( w, pes->final_arrival_time, 8 );
+        write_state_int( w, pes->dts, 8 );
+        write_state_int( w, pes->pts, 8 );
+        write_state_int( w, pes->frame_type, 1 );
+        write_state_int( w, pes->ref_pic_idc, 4 );
+        write_state_int( w, pes->write_pulldown_info, 1 );
+        write_state_int( w, pes->pic_struct, 4 );
+        write_state_int( w, pes->first_pcr, 8 );
+        write_state_bytes( w, pes->data, pes->size );
+    }
+
+    write_state_int( w, w->num_reorder_frames, 4 );
+    for( int i = 0; i < w->num_reorder_frames; i++ )
+    {
+        ts_frame_t *frame = &w->reorder_frames[i];
+        write_state_int( w, frame->pid, 2 );
+        write_state_int( w, frame->size, 4 );
+        write_state_int( w, frame->cpb_initial_arrival_time, 8 );
+        write_state_int( w, frame->cpb_final_arrival_time, 8 );
+        write_state_int( w, frame->dts, 8 );
+        write_state_int( w, frame->pts, 8 );
+        write_state_int( w, frame->duration, 8 );
+        write_state_int( w, frame->random_access, 1 );
+        write_state_int( w, frame->priority, 1 );
+        write_state_int( w, frame->frame_type, 1 );
+        write_state_int( w, frame->ref_pic_idc, 4 );
+        write_state_int( w, frame->write_pulldown_info, 1 );
+        write_state_int( w, frame->pic_struct, 4 );
+        write_state_bytes( w, frame->data, frame->size );
+    }
+
+    write_state_int( w, w->num_splice_sections, 4 );
+    for( int i = 0; i < w->num_splice_sections; i++ )
+    {
+        ts_frame_t *frame = &w->splice_sections[i];
+        write_state_int( w, frame->pid, 2 );
+        write_state_int( w, frame->size, 4 );
+        write_state_int( w, frame->dts, 8 );
+        write_state_int( w, frame->duration, 8 );
+        write_state_bytes( w, frame->data, frame->size );
+    }
+
+    if( w->state_size < 0 )
+    {
+        fprintf( stderr, "Malloc failed\n" );
         return -1;
     }
 
-    return 0;
-}
+    *state = w->state;
+    *size = w->state_size;
 
-void ts_remove_sdt( ts_writer_t *w )
-{
-    free( w->sdt );
-    w->sdt = NULL;
+    return 0;
 }
 
-int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len, int64_t **pcr_list )
+/* the state is checked against the configuration of the writer without changing anything, then applied */
+static int read_state( ts_writer_t *w, uint8_t *p, uint8_t *end, int apply )
 {
-    ts_int_program_t *program = w->programs[0];
-    ts_int_stream_t *stream;
+    ts_int_stream_t *tables[] = { w->nit, w->sdt, w->eit, w->tdt, w->sit };
+    int num, num_prev;
 
-    int initial_queued_pes = w->num_buffered_frames;
-    ts_int_pes_t **queued_pes;
-    ts_int_pes_t **new_pes;
+    if( read_state_int( &p, end, 4 ) != STATE_MAGIC || read_state_int( &p, end, 1 ) != STATE_VERSION )
+    {
+        fprintf( stderr, "Invalid saved state\n" );
+        return -1;
+    }
 
-    int stuffing, flags, pkt_bytes_left, write_pcr, write_adapt_field, adapt_field_len, pes_start, running;
-    uint8_t temp[200];
-    bs_t q;
-    bs_t *s = &w->out.bs;
-    /* earliest arrival time that the pes packet can arrive */
-    int64_t cur_pcr = 0;
+    if( read_state_int( &p, end, 4 ) != w->ts_muxrate )
+    {
+        fprintf( stderr, "Saved state has a different muxrate\n" );
+        return -1;
+    }
 
-    w->num_pcrs = 0;
+    {
+        uint64_t bytes_written = read_state_int( &p, end, 8 );
+        uint64_t packets_written = read_state_int( &p, end, 8 );
+        uint64_t pcr_start = read_state_int( &p, end, 8 );
+        int64_t last_input_dts = read_state_int( &p, end, 8 );
+        int64_t pcr_clock = read_state_int( &p, end, 8 );
+        int clock_locked = read_state_int( &p, end, 1 );
+        int64_t clock_ref_start = read_state_int( &p, end, 8 );
+        int64_t clock_pcr_start = read_state_int( &p, end, 8 );
+        int64_t clock_last_ref = read_state_int( &p, end, 8 );
+        uint64_t clock_offset = read_state_int( &p, end, 8 );
+        uint64_t late_packets = read_state_int( &p, end, 8 );
+        uint64_t shed_data_frames = read_state_int( &p, end, 8 );
+        uint64_t shed_video_frames = read_state_int( &p, end, 8 );
+        uint64_t shed_bytes = read_state_int( &p, end, 8 );
+        uint64_t reorder_late_frames = read_state_int( &p, end, 8 );
+        int first_input = read_state_int( &p, end, 1 );
+        int pat_cc = read_state_int( &p, end, 1 );
+        int pat_version = read_state_int( &p, end, 1 );
+        int sdt_version = read_state_int( &p, end, 1 );
+        int nit_version = read_state_int( &p, end, 1 );
+
+        if( apply )
+        {
+            w->bytes_written = bytes_written;
+            w->packets_written = packets_written;
+            w->pcr_start = pcr_start;
+            w->last_input_dts = last_input_dts;
+            w->pcr_clock = pcr_clock;
+            w->clock_locked = clock_locked;
+            w->clock_ref_start = clock_ref_start;
+            w->clock_pcr_start = clock_pcr_start;
+            w->clock_last_ref = clock_last_ref;
+            memcpy( &w->clock_offset, &clock_offset, sizeof(w->clock_offset) );
+            w->late_packets = late_packets;
+            w->shed_data_frames = shed_data_frames;
+            w->shed_video_frames = shed_video_frames;
+            w->shed_bytes = shed_bytes;
+            w->reorder_late_frames = reorder_late_frames;
+            w->first_input = first_input;
+            w->pat_cc = pat_cc;
+            w->pat_version = pat_version;
+            w->sdt_version = sdt_version;
+            w->nit_version = nit_version;
+        }
+    }
 
-    bs_init( s, w->out.p_bitstream, w->out.i_bitstream );
+    read_state_buffer( &p, end, &w->tb, apply );
+    read_state_buffer( &p, end, &w->main_b, apply );
+    read_state_buffer( &p, end, &w->si_b, apply );
 
-    if( num_frames < 0 )
+    for( int i = 0; i < sizeof(tables) / sizeof(tables[0]); i++ )
     {
-        fprintf( stderr, "Invalid number of frames\n" );
+        int cc = read_state_int( &p, end, 1 );
+        if( p && ( cc < 0 ) != !tables[i] )
+        {
+            fprintf( stderr, "Saved state has different service information tables\n" );
+            return -1;
+        }
+        if( apply && tables[i] )
+            tables[i]->cc = cc;
+    }
+
+    if( read_state_psi_queue( &p, end, &w->system_queue, apply ) < 0 ||
+        read_state_psi_queue( &p, end, &w->si_queue, apply ) < 0 )
         return -1;
+    {
+        int fcc_psi_left = read_state_int( &p, end, 4 );
+        if( apply )
+            w->fcc_psi_left = MIN( MAX( fcc_psi_left, 0 ), psi_queued( &w->system_queue ) );
     }
 
-    if( num_frames )
+    num = read_state_int( &p, end, 4 );
+    if( p && num != w->num_carousels )
     {
-        ts_int_pes_t **tmp = realloc( w->buffered_frames, (w->num_buffered_frames+num_frames) * sizeof(w->buffered_frames[0]) );
-        if( !tmp )
+        fprintf( stderr, "Saved state has a different number of carousels\n" );
+        return -1;
+    }
+    for( int i = 0; i < num && p; i++ )
+    {
+        int table = read_state_int( &p, end, 1 );
+        int id = read_state_int( &p, end, 4 );
+        int pid = read_state_int( &p, end, 2 );
+        int cc = read_state_int( &p, end, 1 );
+        int num_packets = read_state_int( &p, end, 4 );
+        int64_t next_send = read_state_int( &p, end, 8 );
+        int64_t queued_until = read_state_int( &p, end, 8 );
+        ts_int_carousel_t *carousel = find_carousel( w, table, id );
+
+        if( p && ( !carousel || carousel->pid != pid ) )
         {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
+            fprintf( stderr, "Carousel on PID %i in saved state not found\n", pid );
+            return -1;
         }
-        w->buffered_frames = tmp;
-        new_pes = &w->buffered_frames[w->num_buffered_frames];
-        w->num_buffered_frames += num_frames;
-    }
 
-    queued_pes = w->buffered_frames;
+        if( apply )
+        {
+            carousel->cc = cc;
+            carousel->num_packets = num_packets;
+            carousel->next_send = next_send;
+            carousel->queued_until = queued_until;
+        }
+    }
 
-    for( int i = 0; i < num_frames; i++ )
+    num = read_state_int( &p, end, 4 );
+    if( p && num != w->num_fill_sources )
     {
-        stream = find_stream( w, frames[i].pid );
+        fprintf( stderr, "Saved state has a different number of fill sources\n" );
+        return -1;
+    }
+    for( int i = 0; i < num && p; i++ )
+    {
+        int pid = read_state_int( &p, end, 2 );
+        int cc = read_state_int( &p, end, 1 );
+        int64_t next_send = read_state_int( &p, end, 8 );
+        ts_int_fill_source_t *source = find_fill_source( w, pid );
 
-        if( !stream )
+        if( p && !source )
         {
-            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
+            fprintf( stderr, "Fill source %i in saved state not found\n", pid );
             return -1;
         }
 
-        /* Codec specific parameters */
-        if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+        if( apply )
         {
-            if( !stream->mpegvideo_ctx )
-            {
-               fprintf( stderr, "MPEG video stream needs additional information. Call ts_setup_mpegvideo_stream \n" );
-               return -1;
-            }
-            program->video_dts = frames[i].dts;
+            source->cc = cc;
+            source->next_send = next_send;
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+    }
+
+    num = read_state_int( &p, end, 4 );
+    if( p && num != w->num_programs )
+    {
+        fprintf( stderr, "Saved state has a different number of programs\n" );
+        return -1;
+    }
+    for( int i = 0; i < num && p; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
+        int pmt_cc = read_state_int( &p, end, 1 );
+        int pmt_version = read_state_int( &p, end, 1 );
+        uint64_t last_pcr = read_state_int( &p, end, 8 );
+        int64_t video_dts = read_state_int( &p, end, 8 );
+        int pcr_cc = read_state_int( &p, end, 1 );
+        int num_streams = read_state_int( &p, end, 4 );
+
+        if( p && num_streams != program->num_streams )
         {
-            if( !stream->dvb_sub_ctx )
-            {
-               fprintf( stderr, "DVB subtitle stream needs additional information. Call ts_setup_dvb_subtitles \n" );
-               return -1;
-            }
+            fprintf( stderr, "Saved state has a different number of streams\n" );
+            return -1;
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+
+        if( apply )
         {
-            if( !stream->dvb_ttx_ctx )
-            {
-               fprintf( stderr, "DVB Teletext stream needs additional information. Call ts_setup_dvb_teletext \n" );
-               return -1;
-            }
+            program->pmt.cc = pmt_cc;
+            program->pmt_version = pmt_version;
+            program->last_pcr = last_pcr;
+            program->video_dts = video_dts;
+            program->pcr_stream->cc = pcr_cc;
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
+
+        for( int j = 0; j < num_streams && p; j++ )
+        {
+            if( read_stream_state( w, &p, end, apply ) < 0 )
+                return -1;
+        }
+    }
+
+    num = read_state_int( &p, end, 4 );
+    num_prev = read_state_int( &p, end, 4 );
+    if( p && ( num < 0 || num_prev < 0 ) )
+    {
+        fprintf( stderr, "Invalid saved state\n" );
+        return -1;
+    }
+
+    if( apply )
+    {
+        for( int i = 0; i < w->num_buffered_frames; i++ )
+        {
+            pes_dropped( w, w->buffered_frames[i] );
+            free( w->buffered_frames[i]->data );
+            free( w->buffered_frames[i] );
+        }
+        w->num_buffered_frames = 0;
+
+        if( num )
         {
-            if( !stream->dvb_vbi_ctx )
+            ts_int_pes_t **tmp = realloc( w->buffered_frames, num * sizeof(*w->buffered_frames) );
+            if( !tmp )
             {
-               fprintf( stderr, "DVB VBI stream needs additional information. Call ts_setup_dvb_vbi \n" );
-               return -1;
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
             }
+            w->buffered_frames = tmp;
         }
-        // TODO more
+        w->num_prev_buffered_frames = num_prev;
+    }
 
-        new_pes[i] = calloc( 1, sizeof(ts_int_pes_t) );
-        if( !new_pes[i] )
+    for( int i = 0; i < num && p; i++ )
+    {
+        ts_int_pes_t pes;
+        int pid = read_state_int( &p, end, 2 );
+        int offset;
+        uint8_t *data;
+
+        pes.stream = find_stream( w, pid );
+        pes.size = read_state_int( &p, end, 4 );
+        offset = read_state_int( &p, end, 4 );
+        pes.bytes_left = read_state_int( &p, end, 4 );
+        pes.complete = read_state_int( &p, end, 1 );
+        pes.header_size = read_state_int( &p, end, 4 );
+        pes.random_access = read_state_int( &p, end, 1 );
+        pes.priority = read_state_int( &p, end, 1 );
+        pes.fcc_psi_sent = read_state_int( &p, end, 1 );
+        pes.initial_arrival_time = read_state_int( &p, end, 8 );
+        pes.final_arrival_time = read_state_int( &p, end, 8 );
+        pes.dts = read_state_int( &p, end, 8 );
+        pes.pts = read_state_int( &p, end, 8 );
+        pes.frame_type = read_state_int( &p, end, 1 );
+        pes.ref_pic_idc = read_state_int( &p, end, 4 );
+        pes.write_pulldown_info = read_state_int( &p, end, 1 );
+        pes.pic_struct = read_state_int( &p, end, 4 );
+        pes.first_pcr = read_state_int( &p, end, 8 );
+        data = read_state_bytes( &p, end, pes.size );
+
+        if( !p )
+            break;
+
+        if( !pes.stream || pes.size < 0 || offset < 0 || offset > pes.size || pes.bytes_left != pes.size - offset ||
+            pes.header_size < 0 || pes.header_size > pes.size )
         {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
+            fprintf( stderr, "Frame on PID %i in saved state is invalid\n", pid );
+            return -1;
         }
 
-        new_pes[i]->stream = stream;
-        new_pes[i]->random_access = !!frames[i].random_access;
-        new_pes[i]->priority = !!frames[i].priority;
-        new_pes[i]->dts = frames[i].dts + TS_START * TIMESTAMP_CLOCK;
-        new_pes[i]->pts = frames[i].pts + TS_START * TIMESTAMP_CLOCK;
-
-        if( IS_VIDEO( stream ) )
+        if( apply )
         {
-            new_pes[i]->frame_type = frames[i].frame_type;
-            new_pes[i]->initial_arrival_time = frames[i].cpb_initial_arrival_time + TS_START * TS_CLOCK;
-            new_pes[i]->final_arrival_time = frames[i].cpb_final_arrival_time + TS_START * TS_CLOCK;
-            new_pes[i]->ref_pic_idc = frames[i].ref_pic_idc;
-            new_pes[i]->write_pulldown_info = frames[i].write_pulldown_info;
-            new_pes[i]->pic_struct = frames[i].pic_struct;
+            ts_int_pes_t *new_pes = malloc( sizeof(*new_pes) );
+            pes.data_alloced = MAX( pes.size, 1 );
+            pes.data = malloc( pes.data_alloced );
+            if( !new_pes || !pes.data )
+            {
+                free( new_pes );
+                free( pes.data );
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
+            }
+            memcpy( pes.data, data, pes.size );
+            pes.cur_pos = pes.data + offset;
+            pes.opaque = NULL;
+            pes.input_time = get_input_time( w );
+            *new_pes = pes;
+            w->buffered_frames[w->num_buffered_frames++] = new_pes;
         }
-        else if( stream->stream_format == LIBMPEGTS_AUDIO_302M || stream->stream_format == LIBMPEGTS_DATA_SCTE35 || stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts * 300) - frames[i].duration;
-        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - 3600) * 300; /* Teletext is special because data can only stay in the buffer for 40ms */
-        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
-            new_pes[i]->initial_arrival_time = 0; /* FIXME: is this right? */
-        else if( stream->stream_format == LIBMPEGTS_DVB_VBI && ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - 3003) * 300; /* SCTE-127 VBI is always in terms of NTSC */
-        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - 3600) * 300;
-        else
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - stream->max_frame_size) * 300; /* earliest that a frame can arrive */
+    }
 
-        if( !IS_VIDEO( stream ) )
-            new_pes[i]->final_arrival_time = new_pes[i]->dts * 300;
+    num = p ? read_state_int( &p, end, 4 ) : 0;
+    if( p && ( num < 0 || end - p < (int64_t)num * 58 ) )
+        p = NULL;
 
-        /* probe the first normal looking ac3 frame if extra data is needed */
-        if( !stream->atsc_ac3_ctx && stream->stream_format == LIBMPEGTS_AUDIO_AC3 &&
-            ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) &&
-            frames[i].size > 100 && frames[i].data[0] == 0xb && frames[i].data[1] == 0x77 )
+    if( p && apply )
+    {
+        for( int i = 0; i < w->num_reorder_frames; i++ )
+            free( w->reorder_frames[i].data );
+        w->num_reorder_frames = 0;
+
+        if( num > w->reorder_frames_alloced && alloc_reorder_frames( w, num ) < 0 )
+            return -1;
+    }
+
+    for( int i = 0; i < num && p; i++ )
+    {
+        ts_frame_t frame = {0};
+        uint8_t *data;
+
+        frame.pid = read_state_int( &p, end, 2 );
+        frame.size = read_state_int( &p, end, 4 );
+        frame.cpb_initial_arrival_time = read_state_int( &p, end, 8 );
+        frame.cpb_final_arrival_time = read_state_int( &p, end, 8 );
+        frame.dts = read_state_int( &p, end, 8 );
+        frame.pts = read_state_int( &p, end, 8 );
+        frame.duration = read_state_int( &p, end, 8 );
+        frame.random_access = read_state_int( &p, end, 1 );
+        frame.priority = read_state_int( &p, end, 1 );
+        frame.frame_type = read_state_int( &p, end, 1 );
+        frame.ref_pic_idc = read_state_int( &p, end, 4 );
+        frame.write_pulldown_info = read_state_int( &p, end, 1 );
+        frame.pic_struct = read_state_int( &p, end, 4 );
+        data = read_state_bytes( &p, end, frame.size );
+
+        if( !p )
+            break;
+
+        if( !find_stream( w, frame.pid ) || frame.size < 0 )
         {
-            stream->atsc_ac3_ctx = calloc( 1, sizeof(ts_atsc_ac3_info) );
-            if( !stream->atsc_ac3_ctx  )
+            fprintf( stderr, "Frame on PID %i in saved state is invalid\n", frame.pid );
+            return -1;
+        }
+
+        if( apply )
+        {
+            frame.data = malloc( MAX( frame.size, 1 ) );
+            if( !frame.data )
             {
-               fprintf( stderr, "Malloc failed\n" );
-               return -1;
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
             }
-            parse_ac3_frame( stream->atsc_ac3_ctx, frames[i].data );
+            memcpy( frame.data, data, frame.size );
+            w->reorder_input_times[w->num_reorder_frames] = get_input_time( w );
+            w->reorder_frames[w->num_reorder_frames++] = frame;
         }
+    }
 
-        /* 512 bytes is more than enough for pes overhead */
-        new_pes[i]->data = malloc( frames[i].size + 512 );
-        if( !new_pes[i]->data )
+    num = p ? read_state_int( &p, end, 4 ) : 0;
+    if( p && ( num < 0 || end - p < (int64_t)num * 22 ) )
+        p = NULL;
+
+    if( p && apply )
+    {
+        ts_frame_t *tmp = realloc( w->splice_sections, MAX( num, 1 ) * sizeof(*tmp) );
+        if( !tmp )
         {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
         }
+        w->splice_sections = tmp;
 
-        /* Not technically a PES but put it through the same codepath */
-        if ( stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
+        for( int i = 0; i < w->num_splice_sections; i++ )
+            free( w->splice_sections[i].data );
+        w->num_splice_sections = 0;
+    }
+
+    for( int i = 0; i < num && p; i++ )
+    {
+        ts_frame_t frame = {0};
+        ts_int_stream_t *stream;
+        uint8_t *data;
+
+        frame.pid = read_state_int( &p, end, 2 );
+        frame.size = read_state_int( &p, end, 4 );
+        frame.dts = frame.pts = read_state_int( &p, end, 8 );
+        frame.duration = read_state_int( &p, end, 8 );
+        data = read_state_bytes( &p, end, frame.size );
+
+        if( !p )
+            break;
+
+        stream = find_stream( w, frame.pid );
+        if( !stream || stream->stream_format != LIBMPEGTS_DATA_SCTE35 || frame.size < 0 )
         {
-            new_pes[i]->data[0] = 0; // pointer_field
-            memcpy( new_pes[i]->data+1, frames[i].data, frames[i].size );
-            new_pes[i]->size = new_pes[i]->bytes_left = frames[i].size + 1;
-            new_pes[i]->cur_pos = new_pes[i]->data;
-            new_pes[i]->header_size = 0;
+            fprintf( stderr, "Splice section on PID %i in saved state is invalid\n", frame.pid );
+            return -1;
         }
-        else
+
+        if( apply )
         {
-            new_pes[i]->header_size = write_pes( w, program, &frames[i], new_pes[i] );
+            frame.data = malloc( MAX( frame.size, 1 ) );
+            if( !frame.data )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
+            }
+            memcpy( frame.data, data, frame.size );
+            w->splice_sections[w->num_splice_sections++] = frame;
         }
     }
 
-    if( !w->lowlatency && !initial_queued_pes )
+    if( !p )
     {
-        out = NULL;
-        *len = 0;
-        *pcr_list = NULL;
-        return 0;
+        fprintf( stderr, "Saved state is truncated\n" );
+        return -1;
     }
 
-    write_pcr = 0;
-    running = 1;
+    return 0;
+}
 
-    if( !w->first_input )
-    {
-        if( write_pcr_empty( w, program, 1 ) < 0 )
-            return -1;
-        w->first_input = 1;
-    }
+int ts_restore_state( ts_writer_t *w, uint8_t *state, int size )
+{
+    if( read_state( w, state, state + size, 0 ) < 0 )
+        return -1;
 
+    return read_state( w, state, state + size, 1 );
+}
 
-    int video_found = 0, start = 0;
-    int64_t pcr_stop = 0;
+/* Codec-specific features */
 
-    cur_pcr = get_pcr_int( w, 0 );
+int ts_setup_mpegvideo_stream( ts_writer_t *w, int pid, int level, int profile, int vbv_maxrate, int vbv_bufsize, int frame_rate )
+{
+    int bs_mux, bs_oh;
+    int level_idx = -1;
 
-    if( w->lowlatency )
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
     {
-        /* Find the latest arrival time in the batch of packets delivered */
-        for( int i = 0; i < w->num_buffered_frames; i++ )
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    if( !( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC ) )
+    {
+        fprintf( stderr, "PID is not an MPEG video stream\n" );
+        return -1;
+    }
+
+    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 )
+    {
+        if( level < LIBMPEGTS_MPEG2_LEVEL_LOW || level > LIBMPEGTS_MPEG2_LEVEL_HIGHP )
         {
-            stream = queued_pes[i]->stream;
-            if( queued_pes[i]->final_arrival_time > pcr_stop )
-                pcr_stop = queued_pes[i]->final_arrival_time;
+            fprintf( stderr, "Invalid MPEG-2 Level\n" );
+            return -1;
+        }
+        if( profile < LIBMPEGTS_MPEG2_PROFILE_SIMPLE || profile > LIBMPEGTS_MPEG2_PROFILE_422 )
+        {
+            fprintf( stderr, "Invalid MPEG-2 Profile\n" );
+            return -1;
         }
+
+        for( int i = 0; mpeg2_levels[i].level != 0; i++ )
+            if( level == mpeg2_levels[i].level && profile == mpeg2_levels[i].profile )
+            {
+                level_idx = i;
+                break;
+            }
+
+        if( level_idx == -1 )
+        {
+            fprintf( stderr, "Invalid MPEG-2 Level/Profile combination.\n" );
+            return -1;
+        }
+    }
+    else if( stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+    {
+        for( int i = 0; avc_levels[i].level_idc != 0; i++ )
+            if( level == avc_levels[i].level_idc )
+            {
+                level_idx = i;
+                break;
+            }
+
+        if( level_idx == -1 )
+        {
+            fprintf( stderr, "Invalid AVC Level\n" );
+            return -1;
+        }
+        if( profile < AVC_BASELINE || profile > AVC_CAVLC_444_INTRA )
+        {
+            fprintf( stderr, "Invalid AVC Profile\n" );
+            return -1;
+        }
+    }
+
+    if( !stream->mpegvideo_ctx )
+    {
+        stream->mpegvideo_ctx = calloc( 1, sizeof(mpegvideo_stream_ctx_t) );
+        if( !stream->mpegvideo_ctx )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+    }
+
+    stream->mpegvideo_ctx->level = level;
+    stream->mpegvideo_ctx->profile = profile;
+
+    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 )
+    {
+        bs_mux = 0.004 * mpeg2_levels[level_idx].bitrate;
+        bs_oh = 1.0 * mpeg2_levels[level_idx].bitrate/750.0;
+
+        stream->rx = 1.2 * mpeg2_levels[level_idx].bitrate;
+        stream->eb.buf_size = vbv_bufsize;
+
+        if( level == LIBMPEGTS_MPEG2_LEVEL_LOW || level == LIBMPEGTS_MPEG2_LEVEL_MAIN )
+        {
+            stream->mb.buf_size = bs_mux + bs_oh + mpeg2_levels[level_idx].vbv - vbv_bufsize;
+            stream->rbx = mpeg2_levels[level_idx].bitrate;
+        }
+        else
+        {
+            stream->mb.buf_size = bs_mux + bs_oh;
+            stream->rbx = MIN( 1.05 * vbv_maxrate, mpeg2_levels[level_idx].bitrate );
+        }
+    }
+    else if( stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+    {
+        int factor = (float)nal_factor[stream->mpegvideo_ctx->profile] * 1.2;
+        int bitrate = avc_levels[level_idx].bitrate * factor;
+        bs_mux = 0.004 * MAX( bitrate, 2000000 );
+        bs_oh = 1.0 * MAX( bitrate, 2000000 )/750.0;
+
+        stream->mb.buf_size = bs_mux + bs_oh;
+        stream->eb.buf_size = avc_levels[level_idx].cpb * factor;
+
+        stream->rx = bitrate;
+        stream->rbx = bitrate;
+    }
+
+    return 0;
+}
+
+int ts_setup_mpeg2_aac_stream( ts_writer_t *w, int pid, int profile, int channel_map )
+{
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "AAC not allowed in Blu-Ray\n" );
+        return -1;
+    }
+
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    if( profile < 0 || profile > 1 )
+    {
+        fprintf( stderr, "Invalid AAC profile\n" );
+        return -1;
+    }
+
+    if( channel_map < 0 || channel_map > 7 )
+    {
+        fprintf( stderr, "Invalid AAC channel map\n" );
+        return -1;
+    }
+
+    stream->aac_profile = profile;
+    stream->aac_is_mpeg4    = 0;
+    stream->aac_channel_map = channel_map;
+
+    /* channel map index is pretty much correct so there's no point in writing a LUT */
+    int num_channels = channel_map == LIBMPEGTS_MPEG2_AAC_5_POINT_1_CHANNEL ? 5 : channel_map;
+
+    for( int i = 0; aac_buffers[i].max_channels != 0; i++ )
+    {
+        if( num_channels <= aac_buffers[i].max_channels )
+        {
+            stream->rx = aac_buffers[i].rxn;
+            stream->mb.buf_size = aac_buffers[i].bsn;
+        }
+    }
+    return 0;
+}
+
+int ts_setup_mpeg4_aac_stream( ts_writer_t *w, int pid, int profile_and_level, int num_channels )
+{
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "AAC not allowed in Blu-Ray\n" );
+        return -1;
+    }
+
+    if( profile_and_level <= 0 )
+    {
+        fprintf( stderr, "Invalid Profile and Level value\n" );
+        return -1;
+    }
+
+    if( num_channels <= 0 || num_channels > 48 )
+    {
+        fprintf( stderr, "Invalid number of channels\n" );
+        return -1;
+    }
+
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    stream->aac_profile = profile_and_level;
+    stream->aac_is_mpeg4    = 1;
+
+    for( int i = 0; aac_buffers[i].max_channels != 0; i++ )
+    {
+        if( num_channels <= aac_buffers[i].max_channels )
+        {
+            stream->rx = aac_buffers[i].rxn;
+            stream->mb.buf_size = aac_buffers[i].bsn;
+        }
+    }
+
+    return 0;
+};
+
+int ts_setup_opus_stream( ts_writer_t *w, int pid, int channel_map )
+{
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    stream->opus_channel_map = channel_map;
+
+    return 0;
+}
+
+int ts_setup_dvb_subtitles( ts_writer_t *w, int pid, int has_dds, int num_subtitles, ts_dvb_sub_t *subtitles )
+{
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "DVB Subtitles not allowed in Blu-Ray\n" );
+        return -1;
+    }
+
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    if( !subtitles || !num_subtitles )
+    {
+        fprintf( stderr, "Invalid Number of subtitles\n" );
+        return -1;
+    }
+
+    if( stream->dvb_sub_ctx )
+        free( stream->dvb_sub_ctx );
+
+    stream->dvb_sub_ctx = calloc( 1, num_subtitles * sizeof(ts_dvb_sub_t) );
+    if( !stream->dvb_sub_ctx )
+        return -1;
+
+    stream->num_dvb_sub = num_subtitles;
+    memcpy( stream->dvb_sub_ctx, subtitles, num_subtitles * sizeof(ts_dvb_sub_t) );
+
+    /* Display Definition Segment has different buffer sizes */
+    if( has_dds )
+    {
+        stream->tb.buf_size = DVB_SUB_DDS_TB_SIZE;
+        stream->rx = DVB_SUB_DDS_RXN;
+        stream->mb.buf_size = DVB_SUB_DDS_MB_SIZE;
+    }
+    else
+    {
+        stream->rx = DVB_SUB_RXN;
+        stream->mb.buf_size = DVB_SUB_MB_SIZE;
+    }
+
+    return 0;
+}
+
+int ts_setup_dvb_teletext( ts_writer_t *w, int pid, int num_teletexts, ts_dvb_ttx_t *teletexts )
+{
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "Teletext not allowed in Blu-Ray\n" );
+        return -1;
+    }
+
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    if( !teletexts || !num_teletexts )
+    {
+        fprintf( stderr, "Invalid Number of teletexts\n" );
+        return -1;
+    }
+
+    if( stream->dvb_ttx_ctx )
+        free( stream->dvb_ttx_ctx );
+
+    stream->dvb_ttx_ctx = calloc( 1, num_teletexts * sizeof(ts_dvb_ttx_t) );
+    if( !stream->dvb_ttx_ctx )
+        return -1;
+
+    stream->num_dvb_ttx = num_teletexts;
+    memcpy( stream->dvb_ttx_ctx, teletexts, num_teletexts * sizeof(ts_dvb_ttx_t) );
+
+    stream->tb.buf_size = TELETEXT_T_BS;
+    stream->rx = TELETEXT_RXN;
+    stream->mb.buf_size = TELETEXT_BTTX;
+
+    return 0;
+}
+
+int ts_setup_dvb_vbi( ts_writer_t *w, int pid, int num_vbis, ts_dvb_vbi_t *vbis )
+{
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "VBI not allowed in Blu-Ray\n" );
+        return -1;
+    }
+
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    if( !vbis || !num_vbis )
+    {
+        fprintf( stderr, "Invalid Number of VBI services\n" );
+        return -1;
+    }
+
+    if( stream->dvb_vbi_ctx )
+        free( stream->dvb_vbi_ctx );
+
+    stream->dvb_vbi_ctx = calloc( 1, num_vbis * sizeof(ts_dvb_vbi_t) );
+    if( !stream->dvb_vbi_ctx )
+        return -1;
+
+    stream->num_dvb_vbi = num_vbis;
+    memcpy( stream->dvb_vbi_ctx, vbis, num_vbis * sizeof(ts_dvb_vbi_t) );
+
+    for( int i = 0; i < stream->num_dvb_vbi; i++ )
+    {
+        stream->dvb_vbi_ctx[i].lines = calloc( 1, vbis[i].num_lines * sizeof(ts_dvb_vbi_line_t) );
+        if( !stream->dvb_vbi_ctx[i].lines )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+
+            for( int j = 0; i < stream->num_dvb_vbi; j++ )
+            {
+                if( stream->dvb_vbi_ctx[j].lines )
+                    free( stream->dvb_vbi_ctx[j].lines );
+            }
+
+            free( stream->dvb_vbi_ctx );
+
+            return -1;
+        }
+        memcpy( stream->dvb_vbi_ctx[i].lines, vbis[i].lines, vbis[i].num_lines * sizeof(ts_dvb_vbi_line_t) );
+    }
+
+    if( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC )
+    {
+        stream->rx = SCTE_VBI_RXN;
+        stream->mb.buf_size = SCTE_VBI_MB_SIZE;
+    }
+    else
+    {
+        /* DVB-VBI uses teletext T-STD */
+        stream->tb.buf_size = TELETEXT_T_BS;
+        stream->rx = TELETEXT_RXN;
+        stream->mb.buf_size = TELETEXT_BTTX;
+    }
+
+    return 0;
+}
+
+/* Built-in SI tables have a context for the continuity counter and a carousel entry */
+static void remove_si_table( ts_writer_t *w, ts_int_stream_t **table, int carousel_table )
+{
+    ts_int_carousel_t *carousel = find_carousel( w, carousel_table, 0 );
+
+    if( carousel )
+        remove_carousel( w, carousel );
+
+    free( *table );
+    *table = NULL;
+}
+
+static int setup_si_table( ts_writer_t *w, ts_int_stream_t **table, int carousel_table, int pid )
+{
+    if( *table )
+        return 0;
+
+    *table = calloc( 1, sizeof(**table) );
+    if( !*table )
+    {
+        fprintf( stderr, "malloc failed\n" );
+        return -1;
+    }
+
+    (*table)->pid = pid;
+
+    if( !add_carousel( w, carousel_table, pid ) )
+    {
+        free( *table );
+        *table = NULL;
+        return -1;
+    }
+
+    if( check_carousel_bitrate( w ) < 0 )
+    {
+        remove_si_table( w, table, carousel_table );
+        return -1;
+    }
+
+    return 0;
+}
+
+int ts_setup_sdt( ts_writer_t *w )
+{
+    return setup_si_table( w, &w->sdt, CAROUSEL_SDT, SDT_PID );
+}
+
+void ts_remove_sdt( ts_writer_t *w )
+{
+    remove_si_table( w, &w->sdt, CAROUSEL_SDT );
+}
+
+int ts_setup_nit( ts_writer_t *w )
+{
+    if( !w->network_pid )
+    {
+        fprintf( stderr, "NIT requires a network_PID\n" );
+        return -1;
+    }
+
+    return setup_si_table( w, &w->nit, CAROUSEL_NIT, w->network_pid );
+}
+
+void ts_remove_nit( ts_writer_t *w )
+{
+    remove_si_table( w, &w->nit, CAROUSEL_NIT );
+}
+
+int ts_setup_tdt( ts_writer_t *w )
+{
+    return setup_si_table( w, &w->tdt, CAROUSEL_TDT, TDT_PID );
+}
+
+void ts_remove_tdt( ts_writer_t *w )
+{
+    remove_si_table( w, &w->tdt, CAROUSEL_TDT );
+}
+
+static int check_sections( int num_sections, uint8_t **sections, int *section_lengths )
+{
+    if( num_sections <= 0 || !sections || !section_lengths )
+    {
+        fprintf( stderr, "No sections supplied\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < num_sections; i++ )
+    {
+        if( section_lengths[i] < 3 || section_lengths[i] > 4096 ||
+            section_lengths[i] != 3 + (((sections[i][1] & 0x0f) << 8) | sections[i][2]) )
+        {
+            fprintf( stderr, "Invalid section %i\n", i );
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int ts_add_section_carousel( ts_writer_t *w, int pid, int period, int max_bitrate, int num_sections, uint8_t **sections, int *section_lengths )
+{
+    ts_int_carousel_t *carousel;
+
+    if( pid <= PAT_PID || pid >= 0x1fff || find_stream( w, pid ) )
+    {
+        fprintf( stderr, "Invalid PID %i for section carousel\n", pid );
+        return -1;
+    }
+
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        if( w->carousels[i].table != CAROUSEL_SECTIONS && w->carousels[i].pid == pid )
+        {
+            fprintf( stderr, "PID %i is used by a built-in table\n", pid );
+            return -1;
+        }
+    }
+
+    if( period <= 0 || max_bitrate < 0 )
+    {
+        fprintf( stderr, "Invalid section carousel period or bitrate\n" );
+        return -1;
+    }
+
+    if( check_sections( num_sections, sections, section_lengths ) < 0 )
+        return -1;
+
+    carousel = add_carousel( w, CAROUSEL_SECTIONS, pid );
+    if( !carousel )
+        return -1;
+
+    carousel->period = period;
+    carousel->max_bitrate = max_bitrate;
+
+    if( copy_sections( carousel, num_sections, sections, section_lengths ) < 0 || check_carousel_bitrate( w ) < 0 )
+    {
+        remove_carousel( w, carousel );
+        return -1;
+    }
+
+    return w->carousels[w->num_carousels-1].id;
+}
+
+int ts_update_section_carousel( ts_writer_t *w, int carousel_id, int num_sections, uint8_t **sections, int *section_lengths )
+{
+    ts_int_carousel_t *carousel = find_carousel( w, CAROUSEL_SECTIONS, carousel_id );
+    ts_int_carousel_t old;
+
+    if( !carousel )
+    {
+        fprintf( stderr, "Section carousel %i not found\n", carousel_id );
+        return -1;
+    }
+
+    if( check_sections( num_sections, sections, section_lengths ) < 0 )
+        return -1;
+
+    old = *carousel;
+    if( copy_sections( carousel, num_sections, sections, section_lengths ) < 0 || check_carousel_bitrate( w ) < 0 )
+    {
+        free_sections( carousel );
+        *carousel = old;
+        return -1;
+    }
+    free_sections( &old );
+
+    /* send the new version straight away */
+    carousel->next_send = 0;
+
+    return 0;
+}
+
+int ts_add_fill_source( ts_writer_t *w, int pid, int max_bitrate )
+{
+    ts_int_fill_source_t *tmp;
+
+    if( !w->cbr )
+    {
+        fprintf( stderr, "Fill sources require CBR mode\n" );
+        return -1;
+    }
+
+    if( pid < 0x10 || pid >= 0x1fff || find_stream( w, pid ) || find_fill_source( w, pid ) )
+    {
+        fprintf( stderr, "Invalid PID %i for fill source\n", pid );
+        return -1;
+    }
+
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        if( w->carousels[i].pid == pid )
+        {
+            fprintf( stderr, "PID %i is used by a section carousel\n", pid );
+            return -1;
+        }
+    }
+
+    if( max_bitrate < 0 )
+    {
+        fprintf( stderr, "Invalid fill source bitrate\n" );
+        return -1;
+    }
+
+    tmp = realloc( w->fill_sources, (w->num_fill_sources + 1) * sizeof(*w->fill_sources) );
+    if( !tmp )
+    {
+        fprintf( stderr, "malloc failed\n" );
+        return -1;
+    }
+    w->fill_sources = tmp;
+
+    memset( &w->fill_sources[w->num_fill_sources], 0, sizeof(*w->fill_sources) );
+    w->fill_sources[w->num_fill_sources].pid = pid;
+    w->fill_sources[w->num_fill_sources].max_bitrate = max_bitrate;
+    w->num_fill_sources++;
+
+    return 0;
+}
+
+int ts_queue_fill_packets( ts_writer_t *w, int pid, uint8_t *packets, int num_packets )
+{
+    ts_int_fill_source_t *source = find_fill_source( w, pid );
+
+    if( !source )
+    {
+        fprintf( stderr, "Fill source %i not found\n", pid );
+        return -1;
+    }
+
+    for( int i = 0; i < num_packets; i++ )
+    {
+        if( packets[i * TS_PACKET_SIZE] != 0x47 )
+        {
+            fprintf( stderr, "Fill packet %i has no sync byte\n", i );
+            return -1;
+        }
+    }
+
+    /* discard packets that have been written */
+    source->num_packets -= source->read_pos;
+    memmove( source->packets, &source->packets[source->read_pos * TS_PACKET_SIZE], source->num_packets * TS_PACKET_SIZE );
+    source->read_pos = 0;
+
+    if( source->num_packets + num_packets > source->packets_alloced )
+    {
+        int alloced = MAX( source->packets_alloced * 2, source->num_packets + num_packets );
+        uint8_t *tmp = realloc( source->packets, alloced * TS_PACKET_SIZE );
+        if( !tmp )
+        {
+            fprintf( stderr, "malloc failed\n" );
+            return -1;
+        }
+        source->packets = tmp;
+        source->packets_alloced = alloced;
+    }
+
+    memcpy( &source->packets[source->num_packets * TS_PACKET_SIZE], packets, num_packets * TS_PACKET_SIZE );
+    source->num_packets += num_packets;
+
+    return 0;
+}
+
+int ts_get_fill_level( ts_writer_t *w, int pid )
+{
+    ts_int_fill_source_t *source = find_fill_source( w, pid );
+
+    if( !source )
+    {
+        fprintf( stderr, "Fill source %i not found\n", pid );
+        return -1;
+    }
+
+    return source->num_packets - source->read_pos;
+}
+
+int ts_remove_fill_source( ts_writer_t *w, int pid )
+{
+    ts_int_fill_source_t *source = find_fill_source( w, pid );
+    int idx;
+
+    if( !source )
+    {
+        fprintf( stderr, "Fill source %i not found\n", pid );
+        return -1;
+    }
+
+    free( source->packets );
+
+    idx = source - w->fill_sources;
+    w->num_fill_sources--;
+    memmove( &w->fill_sources[idx], &w->fill_sources[idx+1], (w->num_fill_sources - idx) * sizeof(*w->fill_sources) );
+    w->last_fill_source = 0;
+
+    return 0;
+}
+
+int ts_remove_section_carousel( ts_writer_t *w, int carousel_id )
+{
+    ts_int_carousel_t *carousel = find_carousel( w, CAROUSEL_SECTIONS, carousel_id );
+
+    if( !carousel )
+    {
+        fprintf( stderr, "Section carousel %i not found\n", carousel_id );
+        return -1;
+    }
+
+    remove_carousel( w, carousel );
+
+    return 0;
+}
+
+/* the value congruent to ts modulo mod that is nearest to ref */
+static int64_t unwrap_timestamp( int64_t ts, int64_t ref, int64_t mod )
+{
+    int64_t diff = ref - ts + mod / 2;
+    int64_t k = diff >= 0 ? diff / mod : -((mod - 1 - diff) / mod);
+
+    return ts + k * mod;
+}
+
+/* map an input DTS onto the writer's unbounded timeline
+ * Timestamps can wrap around at 33 bits (e.g. when passed through from an input transport stream) and continue
+ * on from the latest DTS seen on any stream. Timestamps that never wrap are left unchanged.
+ * The caller advances last_input_dts once the frame has been accepted. */
+static int64_t unwrap_input_dts( ts_writer_t *w, int64_t dts )
+{
+    if( w->last_input_dts != INT64_MIN )
+        dts = unwrap_timestamp( dts, w->last_input_dts, TIMESTAMP_MOD );
+
+    return dts;
+}
+
+/* Check that the stream has been set up for a frame to be written on it */
+static int check_frame_stream( ts_int_stream_t *stream )
+{
+    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+    {
+        if( !stream->mpegvideo_ctx )
+        {
+           fprintf( stderr, "MPEG video stream needs additional information. Call ts_setup_mpegvideo_stream \n" );
+           return -1;
+        }
+    }
+    else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+    {
+        if( !stream->dvb_sub_ctx )
+        {
+           fprintf( stderr, "DVB subtitle stream needs additional information. Call ts_setup_dvb_subtitles \n" );
+           return -1;
+        }
+    }
+    else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+    {
+        if( !stream->dvb_ttx_ctx )
+        {
+           fprintf( stderr, "DVB Teletext stream needs additional information. Call ts_setup_dvb_teletext \n" );
+           return -1;
+        }
+    }
+    else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
+    {
+        if( !stream->dvb_vbi_ctx )
+        {
+           fprintf( stderr, "DVB VBI stream needs additional information. Call ts_setup_dvb_vbi \n" );
+           return -1;
+        }
+    }
+    // TODO more
+
+    return 0;
+}
+
+/* Validate the input frames and add them to the queue of buffered pes packets
+ * input_times may be NULL if the frames have just been passed to the writer
+ * On failure none of the frames are queued. */
+static int queue_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, int64_t *input_times )
+{
+    ts_int_program_t *program = w->programs[0];
+    ts_int_stream_t *stream;
+    ts_int_pes_t **new_pes;
+    int64_t now, last_input_dts = w->last_input_dts, video_dts = program->video_dts;
+
+    w->num_prev_buffered_frames = w->num_buffered_frames;
+
+    if( !num_frames )
+        return 0;
+
+    now = get_input_time( w );
+
+    {
+        ts_int_pes_t **tmp = realloc( w->buffered_frames, (w->num_buffered_frames+num_frames) * sizeof(w->buffered_frames[0]) );
+        if( !tmp )
+        {
+           fprintf( stderr, "Malloc failed\n" );
+           return -1;
+        }
+        w->buffered_frames = tmp;
+    }
+
+    new_pes = &w->buffered_frames[w->num_buffered_frames];
+
+    for( int i = 0, j = 0; i < num_frames; i++ )
+    {
+        stream = find_stream( w, frames[i].pid );
+
+        if( !stream )
+        {
+            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
+            goto fail;
+        }
+
+        /* Codec specific parameters */
+        if( check_frame_stream( stream ) < 0 )
+            goto fail;
+
+        int64_t dts = unwrap_input_dts( w, frames[i].dts );
+        int64_t pts = unwrap_timestamp( frames[i].pts, dts, TIMESTAMP_MOD );
+
+        w->last_input_dts = MAX( w->last_input_dts, dts );
+        if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+            program->video_dts = dts;
+
+        /* Consecutive SCTE-35 sections are packed together if they fit in one packet.
+         * Only the first packet of the payload has a pointer_field so a section cannot start in a later one.
+         * Sections with an opaque keep a PES of their own so each gets its completion callback. */
+        if( stream->stream_format == LIBMPEGTS_DATA_SCTE35 && j && new_pes[j-1]->stream == stream &&
+            new_pes[j-1]->size + frames[i].size <= 184 && !new_pes[j-1]->opaque && !frames[i].opaque )
+        {
+            /* data_alloced has room for a whole packet */
+            ts_int_pes_t *pes = new_pes[j-1];
+            memcpy( pes->data + pes->size, frames[i].data, frames[i].size );
+            pes->size += frames[i].size;
+            pes->bytes_left += frames[i].size;
+            continue;
+        }
+
+        new_pes[j] = calloc( 1, sizeof(ts_int_pes_t) );
+        if( !new_pes[j] )
+        {
+           fprintf( stderr, "Malloc failed\n" );
+           goto fail;
+        }
+        w->num_buffered_frames++;
+
+        new_pes[j]->stream = stream;
+        new_pes[j]->random_access = !!frames[i].random_access;
+        new_pes[j]->priority = !!frames[i].priority;
+        new_pes[j]->opaque = frames[i].opaque;
+        new_pes[j]->input_time = input_times ? input_times[i] : now;
+        new_pes[j]->dts = dts + TS_START * TIMESTAMP_CLOCK;
+        new_pes[j]->pts = pts + TS_START * TIMESTAMP_CLOCK;
+
+        if( IS_VIDEO( stream ) )
+        {
+            new_pes[j]->frame_type = frames[i].frame_type;
+            /* arrival times wrap around with the PCR */
+            new_pes[j]->initial_arrival_time = unwrap_timestamp( frames[i].cpb_initial_arrival_time, dts * 300, TIMESTAMP_MOD * 300 ) + TS_START * TS_CLOCK;
+            new_pes[j]->final_arrival_time = unwrap_timestamp( frames[i].cpb_final_arrival_time, dts * 300, TIMESTAMP_MOD * 300 ) + TS_START * TS_CLOCK;
+            new_pes[j]->ref_pic_idc = frames[i].ref_pic_idc;
+            new_pes[j]->write_pulldown_info = frames[i].write_pulldown_info;
+            new_pes[j]->pic_struct = frames[i].pic_struct;
+        }
+        else if( stream->stream_format == LIBMPEGTS_AUDIO_302M || stream->stream_format == LIBMPEGTS_DATA_SCTE35 || stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
+            new_pes[j]->initial_arrival_time = (new_pes[j]->dts * 300) - frames[i].duration;
+        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+            new_pes[j]->initial_arrival_time = (new_pes[j]->dts - 3600) * 300; /* Teletext is special because data can only stay in the buffer for 40ms */
+        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+            new_pes[j]->initial_arrival_time = 0; /* FIXME: is this right? */
+        else if( stream->stream_format == LIBMPEGTS_DVB_VBI && ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) )
+            new_pes[j]->initial_arrival_time = (new_pes[j]->dts - 3003) * 300; /* SCTE-127 VBI is always in terms of NTSC */
+        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
+            new_pes[j]->initial_arrival_time = (new_pes[j]->dts - 3600) * 300;
+        else
+            new_pes[j]->initial_arrival_time = (new_pes[j]->dts - stream->max_frame_size) * 300; /* earliest that a frame can arrive */
+
+        if( !IS_VIDEO( stream ) )
+            new_pes[j]->final_arrival_time = new_pes[j]->dts * 300;
+
+        if( w->mux_delay )
+        {
+            int64_t earliest = new_pes[j]->dts * 300 - (int64_t)w->mux_delay * (TS_CLOCK/1000);
+            new_pes[j]->initial_arrival_time = MAX( new_pes[j]->initial_arrival_time, earliest );
+            new_pes[j]->final_arrival_time = MAX( new_pes[j]->final_arrival_time, new_pes[j]->initial_arrival_time );
+        }
+
+        /* probe the first normal looking ac3 frame if extra data is needed */
+        if( !stream->atsc_ac3_ctx && stream->stream_format == LIBMPEGTS_AUDIO_AC3 &&
+            ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) &&
+            frames[i].size > 100 && frames[i].data[0] == 0xb && frames[i].data[1] == 0x77 )
+        {
+            stream->atsc_ac3_ctx = calloc( 1, sizeof(ts_atsc_ac3_info) );
+            if( !stream->atsc_ac3_ctx  )
+            {
+               fprintf( stderr, "Malloc failed\n" );
+               goto fail;
+            }
+            parse_ac3_frame( stream->atsc_ac3_ctx, frames[i].data );
+        }
+
+        /* 512 bytes is more than enough for pes overhead */
+        new_pes[j]->data_alloced = frames[i].size + 512;
+        new_pes[j]->data = malloc( new_pes[j]->data_alloced );
+        if( !new_pes[j]->data )
+        {
+           fprintf( stderr, "Malloc failed\n" );
+           goto fail;
+        }
+        new_pes[j]->complete = 1;
+
+        /* Not technically a PES but put it through the same codepath */
+        if ( stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
+        {
+            new_pes[j]->data[0] = 0; // pointer_field
+            memcpy( new_pes[j]->data+1, frames[i].data, frames[i].size );
+            new_pes[j]->size = new_pes[j]->bytes_left = frames[i].size + 1;
+            new_pes[j]->cur_pos = new_pes[j]->data;
+            new_pes[j]->header_size = 0;
+        }
+        else
+        {
+            new_pes[j]->header_size = write_pes( w, program, &frames[i], new_pes[j] );
+        }
+        j++;
+    }
+
+    return 0;
+
+fail:
+    for( int i = w->num_prev_buffered_frames; i < w->num_buffered_frames; i++ )
+    {
+        free( w->buffered_frames[i]->data );
+        free( w->buffered_frames[i] );
+    }
+    w->num_buffered_frames = w->num_prev_buffered_frames;
+    w->last_input_dts = last_input_dts;
+    program->video_dts = video_dts;
+
+    return -1;
+}
+
+static int release_reorder_frames( ts_writer_t *w, int64_t release_dts )
+{
+    int num_release, num_video = 0, ret;
+
+    /* only a single video frame can be written at a time */
+    for( num_release = 0; num_release < w->num_reorder_frames; num_release++ )
+    {
+        ts_frame_t *frame = &w->reorder_frames[num_release];
+        if( frame->dts > release_dts || ( IS_VIDEO( find_stream( w, frame->pid ) ) && num_video++ ) )
+            break;
+    }
+
+    /* nothing is queued on failure, so the frames stay here */
+    ret = queue_frames( w, w->reorder_frames, num_release, w->reorder_input_times );
+    if( ret < 0 )
+        return ret;
+
+    for( int i = 0; i < num_release; i++ )
+    {
+        find_stream( w, w->reorder_frames[i].pid )->reorder_dts = w->reorder_frames[i].dts;
+        free( w->reorder_frames[i].data );
+    }
+    w->num_reorder_frames -= num_release;
+    memmove( w->reorder_frames, &w->reorder_frames[num_release], w->num_reorder_frames * sizeof(*w->reorder_frames) );
+    memmove( w->reorder_input_times, &w->reorder_input_times[num_release], w->num_reorder_frames * sizeof(*w->reorder_input_times) );
+
+    return ret;
+}
+
+/* hold the input frames in DTS order and pass on those which are reorder_window behind the newest;
+ * mux_input_frames drains the rest at the end of the stream */
+static int reorder_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames )
+{
+    int64_t now = get_input_time( w );
+
+    /* fail now rather than when the frames are released */
+    for( int i = 0; i < num_frames; i++ )
+    {
+        ts_int_stream_t *stream = find_stream( w, frames[i].pid );
+
+        if( !stream )
+        {
+            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
+            return -1;
+        }
+
+        if( check_frame_stream( stream ) < 0 )
+            return -1;
+    }
+
+    for( int i = 0; i < num_frames; i++ )
+    {
+        ts_int_stream_t *stream = find_stream( w, frames[i].pid );
+        ts_frame_t frame = frames[i];
+        int pos;
+
+        frame.dts = unwrap_input_dts( w, frames[i].dts );
+        frame.pts = unwrap_timestamp( frames[i].pts, frame.dts, TIMESTAMP_MOD );
+
+        if( frame.dts < stream->reorder_dts )
+        {
+            fprintf( stderr, "Frame on PID %i arrived outside the reorder window\n", frame.pid );
+            w->reorder_late_frames++;
+            frame_dropped( w, frame.pid, frame.opaque, -1, now );
+            continue;
+        }
+
+        if( w->num_reorder_frames == w->reorder_frames_alloced &&
+            alloc_reorder_frames( w, MAX( w->reorder_frames_alloced * 2, 16 ) ) < 0 )
+            return -1;
+
+        frame.data = malloc( MAX( frame.size, 1 ) );
+        if( !frame.data )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        memcpy( frame.data, frames[i].data, frame.size );
+
+        /* frames with the same DTS stay in the order they arrived */
+        for( pos = w->num_reorder_frames; pos > 0 && w->reorder_frames[pos-1].dts > frame.dts; pos-- )
+            ;
+        memmove( &w->reorder_frames[pos+1], &w->reorder_frames[pos], (w->num_reorder_frames - pos) * sizeof(*w->reorder_frames) );
+        memmove( &w->reorder_input_times[pos+1], &w->reorder_input_times[pos], (w->num_reorder_frames - pos) * sizeof(*w->reorder_input_times) );
+        w->reorder_frames[pos] = frame;
+        w->reorder_input_times[pos] = now;
+        w->num_reorder_frames++;
+        w->last_input_dts = MAX( w->last_input_dts, frame.dts );
+    }
+
+    if( w->last_input_dts == INT64_MIN )
+        return 0;
+
+    return release_reorder_frames( w, w->last_input_dts - w->reorder_window * (TIMESTAMP_CLOCK/1000) );
+}
+
+static int queue_input_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames )
+{
+    int ret;
+
+    /* pending splice sections go in ahead of the frames so the queue only changes on a write */
+    if( w->num_splice_sections )
+    {
+        ts_frame_t *tmp = realloc( w->splice_sections, (w->num_splice_sections + num_frames) * sizeof(*tmp) );
+        if( !tmp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        w->splice_sections = tmp;
+        if( num_frames )
+            memcpy( &tmp[w->num_splice_sections], frames, num_frames * sizeof(*frames) );
+        frames = tmp;
+        num_frames += w->num_splice_sections;
+    }
+
+    if( w->reorder_window || w->num_reorder_frames )
+        ret = reorder_frames( w, frames, num_frames );
+    else
+        ret = queue_frames( w, frames, num_frames, NULL );
+
+    for( int i = 0; i < w->num_splice_sections; i++ )
+        free( w->splice_sections[i].data );
+    w->num_splice_sections = 0;
+
+    return ret;
+}
+
+/* True VBR: instead of writing imaginary packets, advance the clock to the earliest time anything can be written.
+ * Every time considered is a lower bound so the scheduler makes the same decisions it would have made slot by slot. */
+static int skip_idle_time( ts_writer_t *w, ts_int_program_t *program, int64_t pcr_stop )
+{
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+    int64_t next_event = pcr_stop;
+    int64_t packet_time = (int64_t)TS_PACKET_SIZE * 8 * TS_CLOCK / w->ts_muxrate;
+
+    /* see check_pcr_lookahead */
+    next_event = MIN( next_event, program->last_pcr + w->pcr_period * (TS_CLOCK/1000) * (PCR_LOOKAHEAD_WINDOW - 1) / PCR_LOOKAHEAD_WINDOW -
+                      (int64_t)(TS_PACKET_SIZE + 7) * 8 * 8 * TS_CLOCK / w->ts_muxrate );
+    /* a pending carousel becomes due once its queue has been written */
+    for( int i = 0; i < w->num_carousels; i++ )
+    {
+        if( !carousel_pending( w, &w->carousels[i] ) )
+            next_event = MIN( next_event, w->carousels[i].next_send );
+    }
+    if( psi_queued( &w->system_queue ) )
+        next_event = MIN( next_event, system_room_time( w ) );
+    if( psi_queued( &w->si_queue ) )
+        next_event = MIN( next_event, si_room_time( w ) );
+
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->buffered_frames[i];
+        int64_t eligible = MAX( pes->initial_arrival_time, stream_room_time( w, pes->stream ) );
+
+        if( !pes->complete )
+        {
+            /* the rest of the frame will arrive before pcr_stop */
+            if( pes->bytes_left < 184 )
+                continue;
+        }
+        else if( pes->final_arrival_time > pes->initial_arrival_time )
+        {
+            /* earliest time the remaining packets need to be dripped faster than the frame as a whole */
+            int total_packets = (pes->size + 183) / 184;
+            int packets_left = (pes->bytes_left + 183) / 184;
+            int64_t drip_time = pes->final_arrival_time - (int64_t)packets_left * (pes->final_arrival_time - pes->initial_arrival_time) / total_packets;
+            eligible = MAX( eligible, drip_time + 1 );
+        }
+        else
+            eligible = MAX( eligible, pes->final_arrival_time + 1 );
+
+        next_event = MIN( next_event, eligible );
+    }
+
+    if( next_event - cur_pcr <= packet_time )
+        return increase_pcr( w, 1, 1 );
+
+    drip_buffers( w, program, (double)next_event / TS_CLOCK );
+    w->pcr_start += next_event - cur_pcr;
+
+    return 0;
+}
+
+/**** Overload handling ****/
+static int cmp_pes_dts( const void *a, const void *b )
+{
+    int64_t dts_a = (*(ts_int_pes_t * const *)a)->dts, dts_b = (*(ts_int_pes_t * const *)b)->dts;
+
+    return (dts_a > dts_b) - (dts_a < dts_b);
+}
+
+/* Sort the queue by DTS into margin_frames and count the bytes due by each frame */
+static int sort_queue( ts_writer_t *w )
+{
+    if( w->num_buffered_frames > w->margin_alloced )
+    {
+        ts_int_pes_t **frames = realloc( w->margin_frames, w->num_buffered_frames * sizeof(*w->margin_frames) );
+        if( frames )
+            w->margin_frames = frames;
+
+        int64_t *bytes = realloc( w->margin_bytes, w->num_buffered_frames * sizeof(*w->margin_bytes) );
+        if( bytes )
+            w->margin_bytes = bytes;
+
+        if( !frames || !bytes )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        w->margin_alloced = w->num_buffered_frames;
+    }
+
+    if( w->num_buffered_frames )
+        memcpy( w->margin_frames, w->buffered_frames, w->num_buffered_frames * sizeof(*w->margin_frames) );
+    qsort( w->margin_frames, w->num_buffered_frames, sizeof(*w->margin_frames), cmp_pes_dts );
+
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+        w->margin_bytes[i] = (i ? w->margin_bytes[i-1] : 0) + w->margin_frames[i]->bytes_left;
+
+    return 0;
+}
+
+/* How early the queued frames can be sent ahead of their DTS if they go out in DTS order at the muxrate.
+ * Ignores PSI and the T-STD so it is an upper bound. The DTS of the frame with the least margin is returned in worst_dts. */
+static int64_t queue_margin( ts_writer_t *w, int64_t cur_pcr, int64_t *worst_dts )
+{
+    int64_t margin = INT64_MAX;
+
+    *worst_dts = INT64_MIN;
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->margin_frames[i];
+
+        /* frames with the same DTS are all due by then */
+        if( i + 1 < w->num_buffered_frames && w->margin_frames[i+1]->dts == pes->dts )
+            continue;
+
+        int64_t packets = (w->margin_bytes[i] + 183) / 184;
+        int64_t send_time = cur_pcr + packets * TS_PACKET_SIZE * 8 * TS_CLOCK / w->ts_muxrate;
+        if( pes->dts * 300 - send_time < margin )
+        {
+            margin = pes->dts * 300 - send_time;
+            *worst_dts = pes->dts;
+        }
+    }
+
+    return margin;
+}
+
+/* 1 for data frames, 2 for non-reference video frames, 0 if the frame cannot be shed */
+static int shed_class( ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
+
+    /* frames which have started to be written have to be finished */
+    if( pes->data != pes->cur_pos )
+        return 0;
+
+    if( stream->stream_format == LIBMPEGTS_DVB_SUB || stream->stream_format == LIBMPEGTS_DVB_TELETEXT ||
+        stream->stream_format == LIBMPEGTS_DVB_VBI )
+        return 1;
+
+    if( IS_VIDEO( stream ) && !pes->ref_pic_idc && !pes->random_access && pes->complete )
+        return 2;
+
+    return 0;
+}
+
+/* drop data and then non-reference video frames which are due no later than the latest frame until the rest fit */
+static void shed_frames( ts_writer_t *w, int64_t cur_pcr )
+{
+    /* data goes first, so it is shed whenever video would be */
+    int64_t data_threshold = (int64_t)( w->shed_data_threshold ? MAX( w->shed_data_threshold, w->shed_video_threshold ) : 0 ) * (TS_CLOCK/1000);
+    int64_t video_threshold = (int64_t)w->shed_video_threshold * (TS_CLOCK/1000);
+    int64_t worst_dts;
+
+    if( sort_queue( w ) < 0 )
+        return;
+
+    w->queue_margin = queue_margin( w, cur_pcr, &worst_dts );
+
+    if( ( !w->shed_data_threshold && !w->shed_video_threshold ) || w->simulate )
+        return;
+
+    while( w->queue_margin < MAX( data_threshold, video_threshold ) )
+    {
+        int drop = -1, j;
+
+        /* the oldest data frame, otherwise the oldest non-reference video frame */
+        for( int i = 0; i < w->num_buffered_frames && w->margin_frames[i]->dts <= worst_dts; i++ )
+        {
+            int class = shed_class( w->margin_frames[i] );
+            if( class == 1 && w->queue_margin < data_threshold )
+            {
+                drop = i;
+                break;
+            }
+            if( class == 2 && w->queue_margin < video_threshold && drop < 0 )
+                drop = i;
+        }
+
+        if( drop < 0 )
+            break;
+
+        ts_int_pes_t *pes = w->margin_frames[drop];
+        if( IS_VIDEO( pes->stream ) )
+            w->shed_video_frames++;
+        else
+            w->shed_data_frames++;
+        w->shed_bytes += pes->size;
+
+        /* the frame is no longer due before any of the later ones */
+        w->num_buffered_frames--;
+        for( int i = drop; i < w->num_buffered_frames; i++ )
+        {
+            w->margin_frames[i] = w->margin_frames[i+1];
+            w->margin_bytes[i] = w->margin_bytes[i+1] - pes->bytes_left;
+        }
+
+        for( j = 0; w->buffered_frames[j] != pes; j++ )
+            ;
+        memmove( &w->buffered_frames[j], &w->buffered_frames[j+1], (w->num_buffered_frames - j) * sizeof(*w->buffered_frames) );
+        if( j < w->num_prev_buffered_frames )
+            w->num_prev_buffered_frames--;
+
+        pes_dropped( w, pes );
+        free( pes->data );
+        free( pes );
+
+        w->queue_margin = queue_margin( w, cur_pcr, &worst_dts );
+    }
+}
+
+/* Run the scheduler over the queued pes packets and write the resulting transport stream packets */
+/* append continues the output of the previous call instead of starting a new buffer */
+static int mux_frames( ts_writer_t *w, int num_frames, int append, uint8_t **out, int *len, int64_t **pcr_list )
+{
+    ts_int_program_t *program = w->programs[0];
+    ts_int_stream_t *stream;
+    ts_int_pes_t **queued_pes = w->buffered_frames;
+
+    int stuffing, flags, pkt_bytes_left, write_pcr, write_adapt_field, adapt_field_len, pes_start;
+    uint8_t temp[200];
+    bs_t q;
+    bs_t *s = &w->out.bs;
+    /* earliest arrival time that the pes packet can arrive */
+    int64_t cur_pcr = 0;
+    int has_video = 0;
+
+    if( !w->out.p_bitstream && alloc_output_buffers( w ) < 0 )
+        return -1;
+
+    if( !append )
+    {
+        w->num_pcrs = 0;
+        bs_init( s, w->out.p_bitstream, w->out.i_bitstream );
+    }
+    else
+        bs_realign( s );
+
+    for( int i = 0; i < program->num_streams; i++ )
+        has_video |= IS_VIDEO( program->streams[i] );
+
+    if( !w->lowlatency && w->lookahead && has_video && !w->num_prev_buffered_frames )
+    {
+        out = NULL;
+        *len = 0;
+        *pcr_list = NULL;
+        return 0;
+    }
+
+    write_pcr = 0;
+
+    if( !w->first_input )
+    {
+        if( write_pcr_empty( w, program, 1 ) < 0 )
+            return -1;
+        w->first_input = 1;
+    }
+
+
+    int start = 0;
+    int64_t pcr_stop = 0;
+
+    cur_pcr = get_pcr_int( w, 0 );
+
+    shed_frames( w, cur_pcr );
+
+    if( w->lowlatency )
+    {
+        /* Find the latest arrival time in the batch of packets delivered */
+        for( int i = 0; i < w->num_buffered_frames; i++ )
+        {
+            int64_t arrival_time = queued_pes[i]->final_arrival_time;
+
+            /* only the whole packets of a partial frame that have arrived so far can be written */
+            if( !queued_pes[i]->complete )
+                arrival_time = MAX( cur_pcr, queued_pes[i]->initial_arrival_time ) +
+                               (int64_t)(queued_pes[i]->bytes_left / 184) * TS_PACKET_SIZE * 8 * TS_CLOCK / w->ts_muxrate;
+
+            if( arrival_time > pcr_stop )
+                pcr_stop = arrival_time;
+        }
+    }
+    else if( !has_video )
+    {
+        /* Audio and data only programs are muxed up to the DTS of the newest frame less the latency budget */
+        for( int i = 0; i < w->num_buffered_frames; i++ )
+            pcr_stop = MAX( pcr_stop, queued_pes[i]->final_arrival_time );
+
+        if( num_frames )
+            pcr_stop -= (int64_t)w->no_video_latency * (TS_CLOCK/1000);
+    }
+    else
+    {
+        int num_video = 0, video_idx = 0;
+
+        for( int i = 0; i < w->num_buffered_frames; i++ )
+        {
+            if( IS_VIDEO( queued_pes[i]->stream ) )
+                num_video++;
+        }
+
+        /* loop through and find the time when the video frame lookahead frames from the end of the queue can arrive */
+        for( int i = 0; i < w->num_buffered_frames; i++ )
+        {
+            stream = queued_pes[i]->stream;
+            if( IS_VIDEO( stream ) )
+            {
+                /* last frame is a special case - FIXME: is this acceptable in all use-cases? */
+                if( !num_frames )
+                    pcr_stop = queued_pes[i]->dts;
+                else if( !w->lookahead && video_idx == num_video - 1 )
+                    pcr_stop = queued_pes[i]->final_arrival_time; /* no lookahead so write the newest frame completely */
+                else if( w->lookahead && video_idx && video_idx == num_video - w->lookahead )
+                    pcr_stop = queued_pes[i]->initial_arrival_time; /* earliest that a frame can arrive */
+
+                video_idx++;
+            }
+        }
+    }
+
+    while( cur_pcr < pcr_stop )
+    {
+        //printf("\n pcr_stop %"PRIi64" cur_pcr %"PRIi64" \n", pcr_stop, cur_pcr );
+
+        ts_int_pes_t *pes = NULL;
+        write_adapt_field = adapt_field_len = write_pcr = 0;
+        pkt_bytes_left = 184;
+
+        if( check_bitstream( w ) < 0 )
+            return -1;
+
+        /* write any queued PSI/SI packets, PAT and PMT first */
+        if( psi_queued( &w->system_queue ) && system_has_room( w ) )
+        {
+            if( eject_queued_psi( w, &w->system_queue ) < 0 )
+                return -1;
+            cur_pcr = get_pcr_int( w, 0 );
+            continue;
+        }
+        if( psi_queued( &w->si_queue ) && si_has_room( w ) )
+        {
+            if( eject_queued_psi( w, &w->si_queue ) < 0 )
+                return -1;
+            cur_pcr = get_pcr_int( w, 0 );
+            continue;
+        }
+
+        // FIXME at low bitrates this might need tweaking
+        int need_pcr = check_pcr( w, program );
+        int want_pcr = check_pcr_lookahead( w, program );
+
+        /* Check all the non-video packets first. At the PCR deadline only a non-video PCR stream can be written */
+        if( !need_pcr || !IS_VIDEO( program->pcr_stream ) )
+        {
+            if( !need_pcr && retransmit_psi_and_si( w ) < 0 )
+                return -1;
+
+            for( int i = 0; i < w->num_buffered_frames; i++ )
+            {
+                stream = queued_pes[i]->stream;
+                if( (!pes || queued_pes[i]->dts < pes->dts) && !IS_VIDEO( stream ) && ( !need_pcr || stream == program->pcr_stream ) )
+                {
+                    int total_packets = (queued_pes[i]->size + 183) / 184;
+                    int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
+                    double drip_rate = (double)total_packets/ ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
+                    double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr);
+
+                    /* exclude video packets */
+                    if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream_has_room( w, stream ) &&
+                        ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr ||
+                          ( ( want_pcr || need_pcr ) && stream == program->pcr_stream ) ) )
+                    {
+                        pes = queued_pes[i];
+                    }
+                }
+            }
+        }
+
+        /* See if we can write a video packet if non-audio packets can't be written. */
+        if( !pes || ( need_pcr && IS_VIDEO( program->pcr_stream ) ) )
+        {
+            for( int i = 0; i < w->num_buffered_frames; i++ )
+            {
+                stream = queued_pes[i]->stream;
+                if( IS_VIDEO( stream ) )
+                {
+                    int total_packets = (queued_pes[i]->size + 183) / 184;
+                    int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
+                    double drip_rate = (double)total_packets / ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
+                    double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr );
+
+                    /* A partial frame is written as soon as a whole packet of it has arrived */
+                    if( !queued_pes[i]->complete )
+                    {
+                        if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream_has_room( w, stream ) &&
+                            queued_pes[i]->bytes_left >= 184 && !fcc_hold( w, queued_pes[i], cur_pcr ) )
+                        {
+                            pes = queued_pes[i];
+                            break;
+                        }
+                        continue;
+                    }
+
+                    /* Write a video packet anyway if we can put a PCR on it */
+                    if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream_has_room( w, stream ) &&
+                        !fcc_hold( w, queued_pes[i], cur_pcr ) &&
+                        ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr || need_pcr ||
+                          ( want_pcr && stream == program->pcr_stream ) ) )
+                    {
+                        pes = queued_pes[i];
+                        break;
+                    }
+                }
+            }
+        }
+
+        if( pes && is_fcc_point( w, pes ) && !pes->fcc_psi_sent )
+        {
+            if( send_fcc_psi( w ) < 0 )
+                return -1;
+            pes->fcc_psi_sent = 1;
+            continue;
+        }
+
+        if( pes )
+        {
+            int fcc_pcr = is_fcc_point( w, pes );
+            int splicing = check_splice( w, pes );
+            stream = pes->stream;
+            pes_start = pes->data == pes->cur_pos; /* flag if packet contains pes header */
+            /* packets counted down to a splice point need a fixed size adaptation field so the PCR goes in its own packet */
+            int counting_down = splicing && stream->splice_pending;
+
+            if( pcr_stop < cur_pcr && !w->simulate )
+                fprintf( stderr, "\n pcr_stop is less than pcr pid: %i pcr_stop: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pcr_stop, cur_pcr );
+
+            // FIXME complain less
+            if( pes->dts * 300 < cur_pcr )
+            {
+                w->late_packets++;
+                if( !w->simulate )
+                    fprintf( stderr, "\n dts is less than pcr pid: %i dts: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pes->dts*300, cur_pcr );
+            }
+
+            bs_init( &q, temp, 150 );
+
+            if( ( program->pcr_stream == stream && pes_start ) || splicing )
+                write_adapt_field = 1;
+
+            if( counting_down )
+                stream->splice_countdown = 0;
+
+            if( program->pcr_stream == stream && !counting_down &&
+                ( check_pcr( w, program ) || check_pcr_lookahead( w, program ) || fcc_pcr ) )
+            {
+                /* piggyback pcr on this stream */
+                write_adapt_field = write_pcr = 1;
+            }
+            else if( ( check_pcr( w, program ) || fcc_pcr ) && write_pcr_empty( w, program, 0 ) < 0 )
+                return -1;
+
+#if 0
+            if( IS_VIDEO( stream ) && pes_start )
+            {
+                printf("\n last pcr delta %"PRIi64" \n", get_pcr( w, 0 ) - stream->last_pkt_pcr );
+            }
+#endif
+
+            stream->last_pkt_pcr = cur_pcr;
+
+            if( write_adapt_field )
+            {
+                adapt_field_len = write_adaptation_field( w, &q, program, pes, write_pcr, 1, 0, 0 );
+                pkt_bytes_left -= adapt_field_len;
+            }
+
+            /* DVB AU_Information is large so consider this case */
+            // FIXME consider cablelabs legacy
+            if( !adapt_field_len && pes_start && stream->dvb_au )
+            {
+                adapt_field_len = write_adaptation_field( w, &q, program, pes, 0, 1, 0, 0 );
+                pkt_bytes_left -= adapt_field_len;
+            }
+
+            if( counting_down )
+                stream->splice_countdown = splice_countdown( stream, pes->bytes_left - pkt_bytes_left );
+
+            // TODO CableLabs legacy
+            if( pes->bytes_left >= pkt_bytes_left )
+            {
+                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
+                if( adapt_field_len )
+                    write_adaptation_field( w, s, program, pes, write_pcr, 1, 0, 0 );
+
+                write_bytes( s, pes->cur_pos, pkt_bytes_left );
+                add_to_stream_buffers( stream, pes, pes->cur_pos - pes->data, pkt_bytes_left );
+                pes->cur_pos += pkt_bytes_left;
+                pes->bytes_left -= pkt_bytes_left;
+                if( increase_pcr( w, 1, 0 ) < 0 )
+                    return -1;
+            }
+            else
+            {
+                /* stuff the last packet with an oversized adaptation field */
+                stuffing = pkt_bytes_left - pes->bytes_left;
+                flags = 1;
+
+                /* special case where the adaptation_field_length byte is the stuffing */
+                // FIXME except for cablelabs legacy
+
+                if( stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
+                {
+                    adapt_field_len = 0; /* Theoretically could be made PCR */
+                }
+                else if( stuffing == 1 && !adapt_field_len )
+                {
+                    stuffing = flags = 0;
+                    adapt_field_len = 1;
+                }
+                else if( stuffing && !adapt_field_len )
+                {
+                    adapt_field_len = 2;
+                    stuffing -= 2;  /* 2 bytes for adaptation field in this case. NOTE: needs fixing if more private data added */
+                }
+
+                start = bs_pos( s );
+                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
+                if( adapt_field_len )
+                    write_adaptation_field( w, s, program, pes, write_pcr, flags, stuffing, 0 );
+
+                write_bytes( s, pes->cur_pos, pes->bytes_left );
+                if( stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
+                    write_padding( s, start );
+
+                add_to_stream_buffers( stream, pes, pes->cur_pos - pes->data, pes->bytes_left );
+                pes->bytes_left = 0;
+                if( increase_pcr( w, 1, 0 ) < 0 )
+                    return -1;
+            }
+
+            if( pes_start )
+            {
+                pes->first_pcr = get_pcr_int( w, 0 );
+
+                /* the access unit is removed from the T-STD at its decode time */
+                if( stream->stream_format != LIBMPEGTS_DATA_SCTE35 && queue_access_unit( pes ) < 0 )
+                    return -1;
+            }
+
+            /* the first packet after the splice point has been written */
+            if( splicing && !stream->splice_pending )
+                stream->splice_point_flag = 0;
+
+            if( pes->bytes_left == 0 && pes->complete )
+            {
+                if( w->frame_done && !w->simulate )
+                {
+                    ts_frame_done_t done = { stream->pid, pes->opaque, pes->first_pcr, get_pcr_int( w, 0 ),
+                                             get_queue_time( pes->input_time ) };
+                    w->frame_done( w->frame_done_priv, &done );
+                }
+
+                /* eject the current pes from the queue */
+                for( int i = 0; i < w->num_buffered_frames; i++ )
+                {
+                    if( queued_pes[i] == pes )
+                    {
+                        w->num_buffered_frames--;
+                        memmove( &queued_pes[i], &queued_pes[i+1], (w->num_buffered_frames-i) * sizeof(queued_pes) );
+                        break;
+                    }
+                }
+
+                free( pes->data );
+                free( pes );
+            }
+        }
+        else /* no packets can be written */
+        {
+            if( check_pcr( w, program ) )
+            {
+                if( write_pcr_empty( w, program, 0 ) < 0 )
+                    return -1;
+            }
+            else if( w->cbr )
+            {
+                int ret = write_fill_packet( w );
+                if( ret < 0 || ( !ret && write_null_packet( w ) < 0 ) )
+                    return -1;
+            }
+            else if( w->vbr )
+            {
+                if( skip_idle_time( w, program, pcr_stop ) < 0 )
+                    return -1;
+            }
+            else if( increase_pcr( w, 1, 1 ) < 0 )
+                return -1; /* write imaginary packet in capped vbr mode */
+        }
+        cur_pcr = get_pcr_int( w, 0 );
+    }
+
+    bs_flush( s );
+
+    *out = w->out.p_bitstream;
+    *len = bs_pos( s ) >> 3;
+    *pcr_list = w->pcr_list;
+
+    // TODO if it's the final packet write blu-ray overflows
+    // TODO count bits here
+
+    return 0;
+}
+
+/* at the end of the stream, write out the frames still held for reordering as if they had been passed a video frame at a time */
+static int mux_input_frames( ts_writer_t *w, int num_frames, uint8_t **out, int *len, int64_t **pcr_list )
+{
+    int append = 0;
+
+    while( !num_frames && w->num_reorder_frames )
+    {
+        if( mux_frames( w, 1, append, out, len, pcr_list ) < 0 || release_reorder_frames( w, INT64_MAX ) < 0 ||
+            ( !w->num_reorder_frames && mux_frames( w, 1, 1, out, len, pcr_list ) < 0 ) )
+            return -1;
+        append = 1;
+    }
+
+    return mux_frames( w, num_frames, append, out, len, pcr_list );
+}
+
+int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len, int64_t **pcr_list )
+{
+    if( num_frames < 0 )
+    {
+        fprintf( stderr, "Invalid number of frames\n" );
+        return -1;
+    }
+
+    if( queue_input_frames( w, frames, num_frames ) < 0 )
+        return -1;
+
+    return mux_input_frames( w, num_frames, out, len, pcr_list );
+}
+
+int ts_write_frame_chunk( ts_writer_t *w, ts_frame_t *chunk, int chunk_flags, uint8_t **out, int *len, int64_t **pcr_list )
+{
+    ts_int_stream_t *stream = find_stream( w, chunk->pid );
+    ts_int_pes_t *pes = NULL;
+
+    if( !stream )
+    {
+        fprintf( stderr, "PID %i not found for frame chunk\n", chunk->pid );
+        return -1;
+    }
+
+    if( !w->lowlatency )
+    {
+        fprintf( stderr, "Frame chunks require lowlatency mode\n" );
+        return -1;
+    }
+
+    if( w->reorder_window || w->num_reorder_frames )
+    {
+        fprintf( stderr, "Frame chunks cannot be used with a reorder window\n" );
+        return -1;
+    }
+
+    /* PES_packet_length is only unbounded for video */
+    if( !IS_VIDEO( stream ) && chunk_flags != (LIBMPEGTS_CHUNK_START|LIBMPEGTS_CHUNK_END) )
+    {
+        fprintf( stderr, "Frame chunks are only supported for video streams\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        if( w->buffered_frames[i]->stream == stream && !w->buffered_frames[i]->complete )
+            pes = w->buffered_frames[i];
+    }
+
+    if( chunk_flags & LIBMPEGTS_CHUNK_START )
+    {
+        if( pes )
+        {
+            fprintf( stderr, "Previous frame on PID %i was not ended\n", chunk->pid );
+            return -1;
+        }
+
+        if( queue_input_frames( w, chunk, 1 ) < 0 )
+            return -1;
+
+        pes = w->buffered_frames[w->num_buffered_frames-1];
+    }
+    else
+    {
+        if( !pes )
+        {
+            fprintf( stderr, "No frame started on PID %i\n", chunk->pid );
+            return -1;
+        }
+
+        w->num_prev_buffered_frames = w->num_buffered_frames;
+
+        if( pes->size + chunk->size > pes->data_alloced )
+        {
+            int cur_pos = pes->cur_pos - pes->data;
+            int alloced = MAX( pes->data_alloced * 2, pes->size + chunk->size );
+            uint8_t *tmp = realloc( pes->data, alloced );
+            if( !tmp )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
+            }
+            pes->data = tmp;
+            pes->data_alloced = alloced;
+            pes->cur_pos = pes->data + cur_pos;
+        }
+
+        memcpy( pes->data + pes->size, chunk->data, chunk->size );
+        pes->size += chunk->size;
+        pes->bytes_left += chunk->size;
+
+        if( pes->cur_pos != pes->data )
+            grow_access_unit( pes, chunk->size * 8 );
+    }
+
+    pes->complete = !!(chunk_flags & LIBMPEGTS_CHUNK_END);
+
+    return mux_frames( w, 1, 0, out, len, pcr_list );
+}
+
+/* Two-pass muxing */
+/* mux all the frames with a clone of the writer at the given muxrate and return the number of late packets */
+static int64_t simulate_mux( ts_writer_t *template, ts_frame_t *frames, int num_frames, int muxrate )
+{
+    ts_writer_t *w = ts_clone_writer( template );
+    int64_t late_packets = -1;
+    uint8_t *out;
+    int len;
+    int64_t *pcr_list;
+    int start = 0, has_video = 0;
+
+    if( !w )
+        return -1;
+
+    for( int i = 0; i < w->programs[0]->num_streams; i++ )
+        has_video |= IS_VIDEO( w->programs[0]->streams[i] );
+
+    w->simulate = 1;
+    w->ts_muxrate = muxrate;
+    w->r_sys = MAX( R_SYS_DEFAULT, (double)w->ts_muxrate / 500 );
+
+    /* Only a single video frame can be written at a time so split the input before each video frame */
+    for( int i = 1; i <= num_frames; i++ )
+    {
+        ts_int_stream_t *stream = i < num_frames ? find_stream( w, frames[i].pid ) : NULL;
+        if( !stream || IS_VIDEO( stream ) || !has_video )
+        {
+            if( ts_write_frames( w, &frames[start], i - start, &out, &len, &pcr_list ) < 0 )
+                goto end;
+            start = i;
+        }
+    }
+
+    if( ts_write_frames( w, NULL, 0, &out, &len, &pcr_list ) < 0 )
+        goto end;
+
+    late_packets = w->late_packets;
+
+end:
+    ts_close_writer( w );
+    return late_packets;
+}
+
+int ts_find_min_muxrate( ts_writer_t *w, ts_frame_t *frames, int num_frames, int *muxrate, int num_peaks, ts_stream_peak_t *peaks )
+{
+    int64_t min_dts = INT64_MAX, max_dts = INT64_MIN, total_bits = 0, late_packets;
+    int lo, hi;
+
+    if( num_frames <= 0 || num_peaks < 0 )
+    {
+        fprintf( stderr, "Invalid number of frames\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < num_frames; i++ )
+    {
+        if( !find_stream( w, frames[i].pid ) )
+        {
+            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
+            return -1;
+        }
+        min_dts = MIN( min_dts, frames[i].dts );
+        max_dts = MAX( max_dts, frames[i].dts );
+        total_bits += (int64_t)frames[i].size * 8;
+    }
+
+    /* peak bitrate of each stream over any one second window */
+    for( int i = 0; i < num_peaks; i++ )
+    {
+        int64_t window_bits = 0;
+        int first = 0;
+
+        peaks[i].peak_bitrate = 0;
+        for( int j = 0; j < num_frames; j++ )
+        {
+            if( frames[j].pid != peaks[i].pid )
+                continue;
+
+            window_bits += (int64_t)frames[j].size * 8;
+            for( ; first < j && ( frames[first].pid != peaks[i].pid || frames[j].dts - frames[first].dts >= TIMESTAMP_CLOCK ); first++ )
+            {
+                if( frames[first].pid == peaks[i].pid )
+                    window_bits -= (int64_t)frames[first].size * 8;
+            }
+
+            peaks[i].peak_bitrate = MAX( peaks[i].peak_bitrate, window_bits );
+        }
+    }
+
+    /* the average payload bitrate is a lower bound, the configured muxrate is the upper bound */
+    hi = w->ts_muxrate;
+    lo = max_dts > min_dts ? MIN( total_bits * TIMESTAMP_CLOCK / (max_dts - min_dts), hi ) : 1;
+
+    late_packets = simulate_mux( w, frames, num_frames, hi );
+    if( late_packets < 0 )
+        return -1;
+    else if( late_packets )
+    {
+        fprintf( stderr, "Frames cannot be muxed at the configured muxrate\n" );
+        return -1;
+    }
+
+    /* binary search to within 0.1% */
+    while( hi - lo > MAX( hi / 1000, 1 ) )
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        late_packets = simulate_mux( w, frames, num_frames, mid );
+        if( late_packets < 0 )
+            return -1;
+        else if( late_packets )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    *muxrate = hi;
+
+    return 0;
+}
+
+void ts_get_stats( ts_writer_t *w, ts_stats_t *stats )
+{
+    stats->late_packets = w->late_packets;
+    stats->shed_data_frames = w->shed_data_frames;
+    stats->shed_video_frames = w->shed_video_frames;
+    stats->shed_bytes = w->shed_bytes;
+    stats->reorder_late_frames = w->reorder_late_frames;
+    stats->queue_margin = MIN( MAX( w->queue_margin / (TS_CLOCK/1000), INT_MIN ), INT_MAX );
+}
+
+void ts_set_frame_done_callback( ts_writer_t *w, ts_frame_done_callback_t callback, void *priv )
+{
+    w->frame_done = callback;
+    w->frame_done_priv = priv;
+}
+
+int ts_add_stream( ts_writer_t *w, ts_stream_t *stream_in )
+{
+    ts_int_program_t *program = w->programs[0];
+    ts_int_stream_t *stream;
+
+    if( program->num_streams == MAX_STREAMS )
+    {
+        fprintf( stderr, "Too many streams\n" );
+        return -1;
+    }
+
+    if( stream_in->pid < 0x10 || stream_in->pid >= 0x1fff || pid_in_use( w, stream_in->pid ) )
+    {
+        fprintf( stderr, "PID %i is invalid or already in use\n", stream_in->pid );
+        return -1;
     }
-    else
+
+    if( stream_in->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_in->stream_format == LIBMPEGTS_VIDEO_AVC )
     {
-        /* loop through and find the time when the second video packet in the queue can arrive */
-        for( int i = 0; i < w->num_buffered_frames; i++ )
+        for( int i = 0; i < program->num_streams; i++ )
         {
-            stream = queued_pes[i]->stream;
-            if( IS_VIDEO( stream ) )
+            if( IS_VIDEO( program->streams[i] ) )
             {
-                /* last frame is a special case - FIXME: is this acceptable in all use-cases? */
-                if( !num_frames )
-                    pcr_stop = queued_pes[i]->dts;
-                else if( !video_found )
-                    video_found = 1;
-                else
-                    pcr_stop = queued_pes[i]->initial_arrival_time; /* earliest that a frame can arrive */
+                fprintf( stderr, "Multiple video streams not allowed\n" );
+                return -1;
             }
         }
     }
 
-    while( cur_pcr < pcr_stop )
+    stream = create_stream( w, stream_in );
+    if( !stream )
+        return -1;
+
+    /* a separate PCR PID becomes part of the new stream */
+    if( program->pcr_stream && program->pcr_stream->pid == stream->pid )
     {
-        //printf("\n pcr_stop %"PRIi64" cur_pcr %"PRIi64" \n", pcr_stop, cur_pcr );
+        stream->cc = program->pcr_stream->cc;
+        free_stream( program->pcr_stream );
+        program->pcr_stream = stream;
+    }
 
-        ts_int_pes_t *pes = NULL;
-        write_adapt_field = adapt_field_len = write_pcr = 0;
-        pkt_bytes_left = 184;
+    program->streams[program->num_streams++] = stream;
+    update_pmt( w, program );
 
-        if( check_bitstream( w ) < 0 )
-            return -1;
+    return 0;
+}
 
-        /* write any queued PMT packets */
-        if( program->num_queued_pmt && w->tb.cur_buf == 0.0 )
-        {
-            eject_queued_pmt( w, program, s );
-            cur_pcr = get_pcr_int( w, 0 );
-            continue;
-        }
+int ts_delete_stream( ts_writer_t *w, int pid )
+{
+    ts_int_program_t *program = w->programs[0];
+    ts_int_stream_t *stream = find_stream( w, pid );
+    int j = 0;
 
-        // FIXME at low bitrates this might need tweaking
-        int need_pcr = check_pcr( w, program );
+    if( !stream )
+    {
+        fprintf( stderr, "PID %i not found\n", pid );
+        return -1;
+    }
 
-        /* Check all the non-video packets first */
-        if( !need_pcr )
+    /* the PCR carries on in packets of its own */
+    if( stream == program->pcr_stream )
+    {
+        ts_int_stream_t *pcr_stream = calloc( 1, sizeof(*pcr_stream) );
+        if( !pcr_stream )
         {
-            retransmit_psi_and_si( w, program );
-
-            for( int i = 0; i < w->num_buffered_frames; i++ )
-            {
-                stream = queued_pes[i]->stream;
-                if( (!pes || queued_pes[i]->dts < pes->dts) && !IS_VIDEO( stream ) )
-                {
-                    int total_packets = (queued_pes[i]->size + 183) / 184;
-                    int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
-                    double drip_rate = (double)total_packets/ ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
-                    double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr);
-
-                    /* exclude video packets */
-                    if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream->tb.cur_buf == 0.0 &&
-                        ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr ) )
-                    {
-                        pes = queued_pes[i];
-                    }
-                }
-            }
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
         }
+        pcr_stream->pid = pid;
+        pcr_stream->cc = stream->cc;
+        program->pcr_stream = pcr_stream;
+    }
 
-        /* See if we can write a video packet if non-audio packets can't be written. */
-        if( !pes || need_pcr )
+    /* drop the queued frames of the stream, including any partially written one */
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->buffered_frames[i];
+        if( pes->stream == stream )
         {
-            for( int i = 0; i < w->num_buffered_frames; i++ )
-            {
-                stream = queued_pes[i]->stream;
-                if( IS_VIDEO( stream ) )
-                {
-                    int total_packets = (queued_pes[i]->size + 183) / 184;
-                    int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
-                    double drip_rate = (double)total_packets / ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
-                    double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr );
-
-                    /* Write a video packet anyway if we can put a PCR on it */
-                    if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream->tb.cur_buf == 0.0 &&
-                        ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr || need_pcr ) )
-                    {
-                        pes = queued_pes[i];
-                        break;
-                    }
-                }
-            }
+            pes_dropped( w, pes );
+            free( pes->data );
+            free( pes );
         }
+        else
+            w->buffered_frames[j++] = pes;
+    }
+    w->num_buffered_frames = j;
+    w->num_prev_buffered_frames = MIN( w->num_prev_buffered_frames, j );
 
-        if( pes )
+    j = 0;
+    for( int i = 0; i < w->num_reorder_frames; i++ )
+    {
+        if( w->reorder_frames[i].pid == pid )
         {
-            stream = pes->stream;
-            pes_start = pes->data == pes->cur_pos; /* flag if packet contains pes header */
-
-            if( pcr_stop < cur_pcr )
-                fprintf( stderr, "\n pcr_stop is less than pcr pid: %i pcr_stop: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pcr_stop, cur_pcr );
+            frame_dropped( w, pid, w->reorder_frames[i].opaque, -1, w->reorder_input_times[i] );
+            free( w->reorder_frames[i].data );
+        }
+        else
+        {
+            w->reorder_input_times[j] = w->reorder_input_times[i];
+            w->reorder_frames[j++] = w->reorder_frames[i];
+        }
+    }
+    w->num_reorder_frames = j;
 
-            // FIXME complain less
-            if( pes->dts * 300 < cur_pcr )
-                fprintf( stderr, "\n dts is less than pcr pid: %i dts: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pes->dts*300, cur_pcr );
+    j = 0;
+    for( int i = 0; i < w->num_splice_sections; i++ )
+    {
+        if( w->splice_sections[i].pid == pid )
+            free( w->splice_sections[i].data );
+        else
+            w->splice_sections[j++] = w->splice_sections[i];
+    }
+    w->num_splice_sections = j;
 
-            bs_init( &q, temp, 150 );
+    if( IS_VIDEO( stream ) )
+        program->video_dts = -1;
 
-            if( program->pcr_stream == stream && pes_start )
-                write_adapt_field = 1;
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        if( program->streams[i] == stream )
+        {
+            program->num_streams--;
+            memmove( &program->streams[i], &program->streams[i+1], (program->num_streams - i) * sizeof(*program->streams) );
+            break;
+        }
+    }
 
-            if( check_pcr( w, program ) )
-            {
-                if( program->pcr_stream == stream )
-                {
-                    /* piggyback pcr on this stream */
-                    write_adapt_field = write_pcr = 1;
-                }
-                else if( write_pcr_empty( w, program, 0 ) < 0 )
-                    return -1;
-            }
+    free_stream( stream );
+    update_pmt( w, program );
 
-#if 0
-            if( IS_VIDEO( stream ) && pes_start )
-            {
-                printf("\n last pcr delta %"PRIi64" \n", get_pcr( w, 0 ) - stream->last_pkt_pcr );
-            }
-#endif
+    return 0;
+}
 
-            stream->last_pkt_pcr = cur_pcr;
+/* SCTE-35 splice_info_section with a splice_insert() */
+static int write_splice_insert( ts_writer_t *w, ts_splice_t *splice, int64_t splice_pts, uint8_t *buf, int size )
+{
+    int64_t pts_time = splice_pts % TIMESTAMP_MOD;
+    int duration_flag = splice->break_duration > 0;
+    bs_t o, *s = &o;
+    int command_length = 15 + 5 * duration_flag;
+
+    bs_init( s, buf, size );
+    bs_write( s, 8, 0xfc );   // table_id
+    bs_write1( s, 0 );        // section_syntax_indicator
+    bs_write1( s, 0 );        // private_indicator
+    bs_write( s, 2, 0x3 );    // sap_type
+    bs_write( s, 12, 11 + command_length + 2 + 4 ); // section_length
+    bs_write( s, 8, 0 );      // protocol_version
+    bs_write1( s, 0 );        // encrypted_packet
+    bs_write( s, 6, 0 );      // encryption_algorithm
+    bs_write1( s, 0 );        // pts_adjustment[32]
+    bs_write32( s, 0 );       // pts_adjustment[31..0]
+    bs_write( s, 8, 0 );      // cw_index
+    bs_write( s, 12, 0xfff ); // tier
+    bs_write( s, 12, command_length ); // splice_command_length
+    bs_write( s, 8, 0x05 );   // splice_command_type = splice_insert
+
+    bs_write32( s, splice->splice_event_id ); // splice_event_id
+    bs_write1( s, 0 );        // splice_event_cancel_indicator
+    bs_write( s, 7, 0x7f );   // reserved
+    bs_write1( s, !!splice->out_of_network ); // out_of_network_indicator
+    bs_write1( s, 1 );        // program_splice_flag
+    bs_write1( s, duration_flag ); // duration_flag
+    bs_write1( s, 0 );        // splice_immediate_flag
+    bs_write( s, 4, 0xf );    // reserved
+
+    /* splice_time() */
+    bs_write1( s, 1 );        // time_specified_flag
+    bs_write( s, 6, 0x3f );   // reserved
+    bs_write1( s, pts_time >> 32 ); // pts_time[32]
+    bs_write32( s, pts_time & 0xffffffff ); // pts_time[31..0]
+
+    if( duration_flag )
+    {
+        /* break_duration() */
+        int64_t duration = splice->break_duration % TIMESTAMP_MOD;
+        bs_write1( s, 1 );    // auto_return
+        bs_write( s, 6, 0x3f ); // reserved
+        bs_write1( s, duration >> 32 ); // duration[32]
+        bs_write32( s, duration & 0xffffffff ); // duration[31..0]
+    }
 
-            if( write_adapt_field )
-            {
-                adapt_field_len = write_adaptation_field( w, &q, program, pes, write_pcr, 1, 0, 0 );
-                pkt_bytes_left -= adapt_field_len;
-            }
+    bs_write( s, 16, splice->unique_program_id ); // unique_program_id
+    bs_write( s, 8, splice->avail_num );       // avail_num
+    bs_write( s, 8, splice->avails_expected ); // avails_expected
 
-            /* DVB AU_Information is large so consider this case */
-            // FIXME consider cablelabs legacy
-            if( !adapt_field_len && pes_start && stream->dvb_au )
-            {
-                adapt_field_len = write_adaptation_field( w, &q, program, pes, 0, 1, 0, 0 );
-                pkt_bytes_left -= adapt_field_len;
-            }
+    bs_write( s, 16, 0 );     // descriptor_loop_length
 
-            // TODO CableLabs legacy
-            if( pes->bytes_left >= pkt_bytes_left )
-            {
-                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
-                if( adapt_field_len )
-                    write_adaptation_field( w, s, program, pes, write_pcr, 1, 0, 0 );
+    bs_flush( s );
+    write_crc( s, 0 );
+    bs_flush( s );
 
-                write_bytes( s, pes->cur_pos, pkt_bytes_left );
-                pes->cur_pos += pkt_bytes_left;
-                pes->bytes_left -= pkt_bytes_left;
-                add_to_buffer( &stream->tb );
-                if( increase_pcr( w, 1, 0 ) < 0 )
-                    return -1;
-            }
-            else
-            {
-                /* stuff the last packet with an oversized adaptation field */
-                stuffing = pkt_bytes_left - pes->bytes_left;
-                flags = 1;
+    return bs_pos( s ) >> 3;
+}
 
-                /* special case where the adaptation_field_length byte is the stuffing */
-                // FIXME except for cablelabs legacy
+int ts_schedule_splice( ts_writer_t *w, ts_splice_t *splice )
+{
+    ts_int_stream_t *stream = find_stream( w, splice->pid );
+    int64_t splice_pts = splice->splice_pts;
 
-                if( stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
-                {
-                    adapt_field_len = 0; /* Theoretically could be made PCR */
-                }
-                else if( stuffing == 1 && !adapt_field_len )
-                {
-                    stuffing = flags = 0;
-                    adapt_field_len = 1;
-                }
-                else if( stuffing && !adapt_field_len )
-                {
-                    adapt_field_len = 2;
-                    stuffing -= 2;  /* 2 bytes for adaptation field in this case. NOTE: needs fixing if more private data added */
-                }
+    if( !stream || stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
+    {
+        fprintf( stderr, "Invalid PID %i for splice\n", splice->pid );
+        return -1;
+    }
 
-                start = bs_pos( s );
-                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
-                if( adapt_field_len )
-                    write_adaptation_field( w, s, program, pes, write_pcr, flags, stuffing, 0 );
+    if( stream->splice_pending )
+    {
+        fprintf( stderr, "Splice already scheduled on PID %i\n", splice->pid );
+        return -1;
+    }
 
-                write_bytes( s, pes->cur_pos, pes->bytes_left );
-                if( stream->stream_format == LIBMPEGTS_DATA_SCTE35 )
-                    write_padding( s, start );
+    if( splice->splice_type < 0 || splice->splice_type > 15 )
+    {
+        fprintf( stderr, "Invalid splice_type\n" );
+        return -1;
+    }
 
-                pes->bytes_left = 0;
-                add_to_buffer( &stream->tb );
-                if( increase_pcr( w, 1, 0 ) < 0 )
-                    return -1;
-            }
+    if( w->last_input_dts != INT64_MIN )
+        splice_pts = unwrap_timestamp( splice_pts, w->last_input_dts, TIMESTAMP_MOD );
+    splice_pts += TS_START * TIMESTAMP_CLOCK;
 
-            if( pes->bytes_left == 0 )
-            {
-                /* eject the current pes from the queue */
-                for( int i = 0; i < w->num_buffered_frames; i++ )
-                {
-                    if( queued_pes[i] == pes )
-                    {
-                        w->num_buffered_frames--;
-                        memmove( &queued_pes[i], &queued_pes[i+1], (w->num_buffered_frames-i) * sizeof(queued_pes) );
-                        break;
-                    }
-                }
+    if( splice->scte35_pid )
+    {
+        ts_int_stream_t *scte35 = find_stream( w, splice->scte35_pid );
+        ts_frame_t *sections, frame = {0};
 
-                free( pes->data );
-                free( pes );
-            }
-        }
-        else /* no packets can be written */
+        if( !scte35 || scte35->stream_format != LIBMPEGTS_DATA_SCTE35 )
         {
-            if( check_pcr( w, program ) )
-            {
-                if( write_pcr_empty( w, program, 0 ) < 0 )
-                    return -1;
-            }
-            else if( w->cbr )
-            {
-                if( write_null_packet( w ) < 0 )
-                    return -1;
-            }
-            else if( increase_pcr( w, 1, 1 ) < 0 )
-                return -1; /* write imaginary packet in capped vbr mode */
+            fprintf( stderr, "PID %i is not a SCTE-35 stream\n", splice->scte35_pid );
+            return -1;
         }
-        cur_pcr = get_pcr_int( w, 0 );
-    }
 
-    bs_flush( s );
+        sections = realloc( w->splice_sections, (w->num_splice_sections + 1) * sizeof(*sections) );
+        if( sections )
+            w->splice_sections = sections;
+        frame.data = malloc( 64 );
+        if( !sections || !frame.data )
+        {
+            free( frame.data );
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
 
-    *out = w->out.p_bitstream;
-    *len = bs_pos( s ) >> 3;
-    *pcr_list = w->pcr_list;
+        /* sent out straight away, due 100ms from now */
+        frame.size = write_splice_insert( w, splice, splice_pts, frame.data, 64 );
+        frame.pid = scte35->pid;
+        frame.dts = frame.pts = get_pcr_int( w, 0 ) / 300 - TS_START * TIMESTAMP_CLOCK + TIMESTAMP_CLOCK / 10;
+        frame.duration = TS_CLOCK / 10;
+        w->splice_sections[w->num_splice_sections++] = frame;
+    }
 
-    // TODO if it's the final packet write blu-ray overflows
-    // TODO count bits here
+    stream->splice_pending = 1;
+    stream->splice_pts = splice_pts;
+    stream->splice_seamless = !!splice->seamless;
+    stream->splice_type = splice->splice_type;
+    stream->splice_ltw = !!splice->ltw;
+    stream->splice_piecewise_rate = !!splice->piecewise_rate;
+    stream->splice_point_flag = 0;
 
     return 0;
 }
 
-int ts_delete_stream( ts_writer_t *w, int pid )
+int ts_close_writer( ts_writer_t *w )
 {
-    // TODO
+    ts_int_stream_t *tables[] = { w->nit, w->sdt, w->eit, w->tdt, w->sit };
+    int pcr_stream_found;
 
-    return 0;
-}
+    /* frames still queued are reported while their streams exist */
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+        pes_dropped( w, w->buffered_frames[i] );
+    for( int i = 0; i < w->num_reorder_frames; i++ )
+        frame_dropped( w, w->reorder_frames[i].pid, w->reorder_frames[i].opaque, -1, w->reorder_input_times[i] );
 
-int ts_close_writer( ts_writer_t *w )
-{
     for( int i = 0; i < w->num_programs; i++ )
     {
+        pcr_stream_found = 0;
         for( int j = 0; j < w->programs[i]->num_streams; j++ )
         {
-            // TODO free other stuff
-            if( w->programs[i]->streams[j]->mpegvideo_ctx )
-                free( w->programs[i]->streams[j]->mpegvideo_ctx );
-            if( w->programs[i]->streams[j]->lpcm_ctx )
-                free( w->programs[i]->streams[j]->lpcm_ctx );
-            if( w->programs[i]->streams[j]->atsc_ac3_ctx )
-                free( w->programs[i]->streams[j]->atsc_ac3_ctx );
-            if( w->programs[i]->streams[j]->dvb_sub_ctx )
-                free( w->programs[i]->streams[j]->dvb_sub_ctx );
-            if( w->programs[i]->streams[j]->dvb_ttx_ctx )
-                free( w->programs[i]->streams[j]->dvb_ttx_ctx );
-            if( w->programs[i]->streams[j]->dvb_vbi_ctx )
-                free( w->programs[i]->streams[j]->dvb_vbi_ctx );
-
-            free( w->programs[i]->streams[j] );
-        }
-
-        for( int j = 0; j < w->programs[i]->num_queued_pmt; j++ )
-            free( w->programs[i]->pmt_packets[j] );
-        if( w->programs[i]->pmt_packets )
-            free( w->programs[i]->pmt_packets );
+            if( w->programs[i]->streams[j] == w->programs[i]->pcr_stream )
+                pcr_stream_found = 1;
+            free_stream( w->programs[i]->streams[j] );
+        }
+
+        /* separate PCR PID */
+        if( !pcr_stream_found && w->programs[i]->pcr_stream )
+            free_stream( w->programs[i]->pcr_stream );
+
         if( w->programs[i]->sdt_ctx.service_name )
             free( w->programs[i]->sdt_ctx.service_name );
         if( w->programs[i]->sdt_ctx.provider_name )
@@ -2045,8 +5550,36 @@ int ts_close_writer( ts_writer_t *w )
 
     free( w->buffered_frames );
 
-    if( w->sdt )
-        free( w->sdt );
+    for( int i = 0; i < w->num_reorder_frames; i++ )
+        free( w->reorder_frames[i].data );
+    free( w->reorder_frames );
+    free( w->reorder_input_times );
+    free( w->margin_frames );
+    free( w->margin_bytes );
+    for( int i = 0; i < w->num_splice_sections; i++ )
+        free( w->splice_sections[i].data );
+    free( w->splice_sections );
+
+    free( w->system_queue.packets );
+    free( w->si_queue.packets );
+
+    for( int i = 0; i < w->num_carousels; i++ )
+        free_sections( &w->carousels[i] );
+    free( w->carousels );
+
+    for( int i = 0; i < w->num_fill_sources; i++ )
+        free( w->fill_sources[i].packets );
+    free( w->fill_sources );
+    free( w->state );
+
+    for( int i = 0; i < sizeof(tables) / sizeof(tables[0]); i++ )
+    {
+        if( tables[i] )
+            free_stream( tables[i] );
+    }
+
+    if( w->dtcp_ctx )
+        free( w->dtcp_ctx );
 
     if( w->pcr_list )
         free( w->pcr_list );
@@ -2117,16 +5650,7 @@ int increase_pcr( ts_writer_t *w, int num_packets, int imaginary )
     // TODO do this for all programs
     ts_int_program_t *program = w->programs[0];
     double next_pcr = get_pcr_double( w, num_packets * TS_PACKET_SIZE );
-    /* buffer drip (TODO: all buffers?) */
-    drip_buffer( w, program, w->rx_sys, &w->tb, next_pcr );
-    for( int i = 0; i < program->num_streams; i++ )
-    {
-        /* SCTE35 is PSI so not part of T-STD */
-        if( program->streams[i]->stream_format == LIBMPEGTS_DATA_SCTE35 )
-            program->streams[i]->tb.cur_buf = 0;
-        else
-            drip_buffer( w, program, program->streams[i]->rx, &program->streams[i]->tb, next_pcr );
-    }
+    drip_buffers( w, program, next_pcr );
 
     w->packets_written += num_packets;
 
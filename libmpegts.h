@@ -31,8 +31,8 @@
 #endif
 
 /**** Version ****/
-#define LIBMPEGTS_API_VERSION_MAJOR 0
-#define LIBMPEGTS_API_VERSION_MINOR 3
+#define LIBMPEGTS_API_VERSION_MAJOR 1
+#define LIBMPEGTS_API_VERSION_MINOR 0
 
 /**** Stream Formats ****/
 /* Generic */
@@ -205,7 +205,12 @@ typedef struct ts_writer_t ts_writer_t;
  *
  * hdmv_frame_rate - For H.264 "Frame-rate = time_scale/num_units_in_tick/2" TODO MPEG-2 (see above #defines)
  * hdmv_aspect_ratio - either LIBMPEGTS_HDMV_AR_4_3 or LIBMPEGTS_HDMV_AR_16_9
- * hdmv_video_format - Video format (see above #defines) */
+ * hdmv_video_format - Video format (see above #defines)
+ *
+ * max_bitrate - Maximum rate of the transport packets of the stream in bits/s, 0 for no limit. Enforced with a leaky
+ *               bucket so that streams which are eligible immediately (e.g. SCTE-35, SMPTE 2038, DVB subtitles) are
+ *               spread out instead of being written in bursts.
+ * max_burst - Size of the leaky bucket in bytes: the most that can be written back-to-back. Minimum of one packet. */
 
 typedef struct
 {
@@ -228,6 +233,9 @@ typedef struct
     int hdmv_frame_rate;
     int hdmv_aspect_ratio;
     int hdmv_video_format;
+
+    int max_bitrate;
+    int max_burst;
 } ts_stream_t;
 
 /**** Stream attributes (DVB) ****/
@@ -293,12 +301,49 @@ ts_writer_t *ts_create_writer( void );
  * ts_id - Transport Stream ID
  * muxrate - Transport stream muxing rate
  * cbr - Pad to constant bitrate with null packets
+ * vbr - True variable bitrate. muxrate is the peak rate and idle time is skipped rather than filled with imaginary packets,
+ *       so PCRs and the pcr_list reflect the intended departure time of each packet. Cannot be combined with cbr.
+ * full_tstd - Schedule packets using the occupancy of the transport, multiplex/main and elementary buffers of the T-STD
+ *             rather than waiting for the transport buffer to empty. Allows lower mux delays.
  * ts_type - Type of transport stream to write
  * network_pid - PID of the network table (0 otherwise)
  * legacy_constraints - Comply with CableLabs legacy contraints in Section 7.3 of Content Encoding Profiles 3.0 Specification
  *
  * retransmit periods in milliseconds
  *
+ * lookahead - number of video frames buffered before the oldest is muxed (not used in lowlatency mode).
+ *             Larger values give the scheduler more freedom to distribute packets smoothly (and write fewer null packets)
+ *             at the expense of latency. 0 uses the default of one frame.
+ *             LIBMPEGTS_NO_LOOKAHEAD writes each video frame completely as soon as it is received.
+ * no_video_latency - For programs without video (e.g. radio or data services) and not in lowlatency mode,
+ *                    how far in milliseconds the mux runs behind the DTS of the newest frame received.
+ *                    Frames of different streams passed in separate calls must be within this budget of each other.
+ * mux_delay - The most in milliseconds that any packet may be sent ahead of the DTS of its frame (0 for no limit).
+ *             This bounds the arrival times of every stream, including the video arrival times from the caller
+ *             and the fixed rules used for audio and data (e.g. the frame duration, 40ms for teletext),
+ *             so latency can be traded against smoothness per channel. Smaller values give the scheduler
+ *             less room to spread frames out and need a higher muxrate to avoid late packets.
+ * fast_channel_change - Write the PAT and PMT, followed by a PCR, in front of every random access point of the video
+ *                       stream so a decoder joining the stream can start on the first one it sees. The PAT/PMT
+ *                       retransmit timer restarts from each random access point. The system T-STD is respected so the
+ *                       video may be delayed slightly, unless it is already late.
+ * shed_data_threshold, shed_video_threshold - Overload handling for live outputs, in milliseconds (0 disables).
+ *             Before each write the writer estimates how early the queued frames can be sent ahead of their DTS
+ *             at the muxrate. While this margin is below shed_data_threshold, DVB subtitle, teletext and VBI
+ *             frames which have not started to be written are dropped, oldest first. While it is below
+ *             shed_video_threshold, non-reference video frames (ref_pic_idc == 0, not random access points)
+ *             are dropped too, but only once there is no data frame left to drop. If data shedding is enabled it
+ *             also uses shed_video_threshold when that is higher, so data always goes before video.
+ *             Counters are available from ts_get_stats.
+ * reorder_window - Accept frames in any order within this many milliseconds (0 disables). Frames are held in DTS order
+ *                  until they are reorder_window behind the newest DTS on any stream, so streams can be passed
+ *                  from different threads without serialising them upstream. A frame which arrives after a frame
+ *                  of the same PID with a later DTS has been released is dropped and counted in ts_get_stats.
+ *                  The rules about the order of frames passed to ts_write_frames then apply to the released frames;
+ *                  at most one video frame is released per call and the held frames are all written out
+ *                  when ts_write_frames is called with num_frames = 0. Frame chunks cannot be used.
+ *                  This adds reorder_window to the latency.
+ *
  * CURRENT LIMITATIONS
  *
  * Single Program Transport Streams only supported currently.
@@ -307,6 +352,8 @@ ts_writer_t *ts_create_writer( void );
  *
  * */
 
+#define LIBMPEGTS_NO_LOOKAHEAD -1
+
 typedef struct ts_main_t
 {
     int num_programs;
@@ -331,18 +378,75 @@ typedef struct ts_main_t
     int nit_period;
     int tdt_period;
     int tot_period;
+
+    int vbr;
+    int full_tstd;
+    int lookahead;
+    int no_video_latency;
+    int mux_delay;
+    int fast_channel_change;
+    int shed_data_threshold;
+    int shed_video_threshold;
+    int reorder_window;
 } ts_main_t;
 
 int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params );
 
 /* update transport stream
  *
- * muxrate is the only tested parameter
+ * params is a complete set of parameters as passed to ts_setup_transport_stream. The muxrate, retransmit periods,
+ * ts_id, network_pid, network_id, lowlatency, lookahead and the other scheduling options can be changed, as can the
+ * language codes of the streams and the SDT information of the program. Streams are matched by PID; use
+ * ts_add_stream and ts_delete_stream to change the set of streams. NULL SDT names are left unchanged.
+ *
+ * The version_number of each affected table is incremented and the new version is sent straight away.
+ * The PCR timeline carries on without a discontinuity.
+ *
+ */
+int ts_update_transport_stream( ts_writer_t *w, ts_main_t *params );
+
+/* Clock reference
+ *
+ * By default the PCR advances at exactly the muxrate, so over time it drifts from the clock the output is paced by.
+ * For live outputs, call ts_set_clock_reference regularly (e.g. before each ts_write_frames) with the time on the
+ * reference clock (e.g. CLOCK_TAI or the capture clock, in 27MHz ticks) at which the next packet written will be sent.
+ * The PCR clock is slewed to stay locked to the reference, within the ISO 13818-1 limits of 810Hz and 0.075Hz/s,
+ * which changes the effective muxrate very slightly.
+ *
+ * The first call takes the lock. If the reference goes backwards or is more than a second away from the PCR timeline,
+ * the lock is taken again without slewing.
+ */
+int ts_set_clock_reference( ts_writer_t *w, int64_t ref_time );
+
+/* Clone Writer
+ *
+ * Creates a new writer with the same configuration as w, including the transport stream parameters,
+ * programs, streams and codec-specific information set up by the ts_setup_* functions.
+ * The clone has fresh mutable state (PCR, continuity counters, T-STD buffers, queued frames)
+ * as if ts_setup_transport_stream had just been called.
+ *
+ * This allows a writer to be configured once as a template and cloned cheaply for fast channel spin-up or failover.
+ * Output buffers are allocated on the first call to ts_write_frames.
+ * The clone is independent of w and must be closed with ts_close_writer.
+ */
+ts_writer_t *ts_clone_writer( ts_writer_t *w );
+
+/* Save and Restore Writer State
+ *
+ * ts_save_state serialises the mutable state of a writer: the PCR timeline, continuity counters, table versions,
+ * T-STD buffer occupancy, carousel deadlines, queued PSI/SI and the frames which have not been completely written.
+ * The configuration is not included. ts_restore_state restores the state into a writer with the same configuration
+ * (e.g. set up by the same calls or with ts_clone_writer), typically a hot standby, which then carries on exactly
+ * where the saved writer left off. Packets queued on fill sources are not included.
  *
- * TODO: implement versioning so other parameters can be updated
+ * The state is portable between machines. It is owned by the writer and valid until the next call of ts_save_state
+ * or ts_close_writer.
  *
+ * If the state does not match the configuration of the writer, ts_restore_state fails without changing the writer.
+ * If it fails for any other reason the writer must be closed.
  */
-void ts_update_transport_stream( ts_writer_t *w, ts_main_t *params );
+int ts_save_state( ts_writer_t *w, uint8_t **state, int *size );
+int ts_restore_state( ts_writer_t *w, uint8_t *state, int size );
 
 /**** Additional Codec-Specific functions ****/
 /* Many formats require extra information. Setup the relevant information using the following functions */
@@ -590,6 +694,53 @@ int ts_setup_sit( ts_writer_t *w );
 void ts_update_sit( ts_writer_t *w );
 int ts_remove_sit( ts_writer_t *w );
 
+/**** Section carousels ****/
+
+/* ts_add_section_carousel
+ *
+ * Retransmits application supplied sections (e.g. EIT schedules, AIT, private tables) on pid.
+ * PAT, PMT and the built-in SI tables are scheduled by the same earliest deadline first carousel.
+ *
+ * Each section must be complete including its CRC_32 where applicable. The sections are copied.
+ * Carousels on the same PID share a continuity counter and are sent in the same sequence of packets if due together.
+ *
+ * period - repetition period in milliseconds
+ * max_bitrate - bitrate budget in bits/s, 0 for none. If the sections outgrow the budget, the period is stretched.
+ *
+ * The total bitrate of all carousels must not exceed the muxrate.
+ *
+ * Returns the carousel id or -1 on error.
+ */
+int ts_add_section_carousel( ts_writer_t *w, int pid, int period, int max_bitrate, int num_sections, uint8_t **sections, int *section_lengths );
+
+/* ts_update_section_carousel replaces the sections of a carousel. The new sections are sent straight away.
+ * The application is responsible for incrementing version_number. */
+int ts_update_section_carousel( ts_writer_t *w, int carousel_id, int num_sections, uint8_t **sections, int *section_lengths );
+int ts_remove_section_carousel( ts_writer_t *w, int carousel_id );
+
+/**** Fill sources ****/
+
+/* ts_add_fill_source
+ *
+ * In CBR mode, packets queued on fill sources are written instead of null packets. Examples are DSM-CC data carousels,
+ * bulk EPG data or software downloads. Fill packets are not part of the T-STD of the program so do not affect the
+ * scheduling of the elementary streams or PSI/SI. Sources are served in turn.
+ *
+ * max_bitrate - bitrate cap in bits/s, 0 for none
+ *
+ * ts_queue_fill_packets takes complete 188-byte transport stream packets. The PID and continuity_counter are
+ * rewritten, everything else is written unchanged. The packets are copied.
+ *
+ * ts_get_fill_level returns the number of packets on a source which have not yet been written so that the
+ * application can keep it topped up.
+ *
+ * A cloned writer has the same fill sources but none of the queued packets.
+ */
+int ts_add_fill_source( ts_writer_t *w, int pid, int max_bitrate );
+int ts_queue_fill_packets( ts_writer_t *w, int pid, uint8_t *packets, int num_packets );
+int ts_get_fill_level( ts_writer_t *w, int pid );
+int ts_remove_fill_source( ts_writer_t *w, int pid );
+
 /**** ATSC/CableLabs specific information ****/
 
 /* ATSC Setup/Update AC3 stream
@@ -649,7 +800,9 @@ int ts_setup_dtcp( ts_writer_t *w, uint8_t byte_1, uint8_t byte_2 );
  * (PTS and DTS may have codec-specific meanings. See ISO 13818-1 for more information)
  * Generally, non-video formats have PTS equal to DTS.
  *
- * This data does not need to be wrapped around )
+ * Timestamps do not need to be wrapped around but may be, e.g. when passed through from an input transport stream.
+ * DTS and PTS that wrap at 33 bits and arrival times that wrap with the PCR are unwrapped against the latest DTS
+ * on any stream, so a writer can run indefinitely with either.
  * random_access - Data contains an "elementary stream access point"
  * priority - Indicate payload has priority
  * (random_access and priority can be codec specific. See ISO 13818-1 for more information.)
@@ -660,7 +813,7 @@ int ts_setup_dtcp( ts_writer_t *w, uint8_t byte_1, uint8_t byte_2 );
  * write_pulldown_info - Write pulldown info in AU_Information
  * pic_struct - AVC pic_struct element - only used if write_pulldown_info set
  *
- * opaque - opaque pointer that libmpegts does nothing with
+ * opaque - opaque pointer that libmpegts does nothing with except pass back to the frame completion callback
  */
 
 typedef struct
@@ -690,17 +843,172 @@ typedef struct
  * libmpegts buffers one frame so the last set of packets can be output by setting num_frames = 0.
  *
  * pcr_list contains an array of pcr values, one for each output packet. The array length is len/188.
- * NOTE: This PCR list does not wrap around
+ * NOTE: This PCR list does not wrap around. It is a monotonic 27MHz timeline suitable for pacing output;
+ *       the PCR in the packets is this value modulo 2^33 * 300.
  *
  */
 
 int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len, int64_t **pcr_list );
 
-/* INACTIVE
+/* ts_write_frame_chunk
+ *
+ * Sub-frame input for ultra-low-latency muxing. Requires lowlatency mode.
+ *
+ * Instead of passing a whole access unit to ts_write_frames, a frame can be submitted in chunks
+ * (e.g. slices) as they are produced. Packets are output for the data that has arrived without
+ * waiting for the rest of the frame, subject to the T-STD constraints.
+ *
+ * The first chunk is flagged with LIBMPEGTS_CHUNK_START and must have all the fields of ts_frame_t set
+ * (timestamps, arrival times, random_access etc) as they apply to the whole frame. Its data is the start of the frame.
+ * Continuation chunks only need pid, data and size. The last chunk is flagged with LIBMPEGTS_CHUNK_END.
+ * A frame contained in a single chunk has both flags set.
+ *
+ * Frames split into more than one chunk are only supported for video streams.
+ * Output is returned as in ts_write_frames.
+ */
+
+#define LIBMPEGTS_CHUNK_START 1
+#define LIBMPEGTS_CHUNK_END   2
+
+int ts_write_frame_chunk( ts_writer_t *w, ts_frame_t *chunk, int chunk_flags, uint8_t **out, int *len, int64_t **pcr_list );
+
+/* ts_find_min_muxrate
+ *
+ * Analysis pass for two-pass (e.g. VOD) muxing.
+ *
+ * Finds the smallest CBR muxrate at which frames can be muxed by w without any packets arriving late at the decoder.
+ * frames is the complete list of frames in the order they would be passed to ts_write_frames.
+ * w must be fully set up; its configured muxrate is the upper bound of the search. w itself is not modified.
+ *
+ * peaks - optional array of num_peaks entries. The calling application sets pid and
+ *         peak_bitrate is returned as the highest bitrate of that stream over any one second window.
+ *
+ * The second (muxing) pass is performed by creating a writer with the returned muxrate
+ * (or calling ts_update_transport_stream before writing any frames) and writing the frames as normal.
+ */
+
+typedef struct
+{
+    int pid;
+    int64_t peak_bitrate;
+} ts_stream_peak_t;
+
+int ts_find_min_muxrate( ts_writer_t *w, ts_frame_t *frames, int num_frames, int *muxrate, int num_peaks, ts_stream_peak_t *peaks );
+
+/* Statistics
  *
+ * late_packets - packets written after the DTS of their frame
+ * shed_data_frames, shed_video_frames, shed_bytes - frames dropped by the overload handling and their total size
+ * reorder_late_frames - frames dropped because they arrived too late for the reorder window
+ * queue_margin - how early in milliseconds the queued frames could be sent ahead of their DTS as of the last write
+ *                (negative if they are going to be late)
+ */
+typedef struct
+{
+    uint64_t late_packets;
+    uint64_t shed_data_frames;
+    uint64_t shed_video_frames;
+    uint64_t shed_bytes;
+    uint64_t reorder_late_frames;
+    int queue_margin;
+} ts_stats_t;
+
+void ts_get_stats( ts_writer_t *w, ts_stats_t *stats );
+
+/* Frame completion callback
+ *
+ * callback is called with priv during a write once the last packet of a frame has been written to the output, and once
+ * for every frame that leaves the writer without being written completely so that buffers keyed on opaque can be freed.
+ *
+ * pid, opaque - as passed in the ts_frame_t, or the first chunk of the frame (opaque is NULL for the
+ *               splice_insert sections written by ts_schedule_splice)
+ * first_pcr, last_pcr - the PCR of the first and last packets of the frame, on the same timeline as pcr_list.
+ *                      -1 if the packet was never written
+ * queue_time - wall clock time in microseconds from when the frame was passed to the writer until its last packet
+ *              was written or it was dropped, including any time spent in the reorder window. Frames restored by
+ *              ts_restore_state count from the restore. 0 for frames passed in before the callback was set.
+ * dropped - the frame was dropped by the overload handling, the reorder window or ts_delete_stream, replaced by
+ *           ts_restore_state or still queued when the writer was closed
+ *
+ * This gives the mux latency of each frame. Frames restored by ts_restore_state are reported with opaque set to
+ * NULL because the saved state cannot carry pointers. splice_insert sections which are dropped are not reported.
+ * Consecutive SCTE-35 sections are only packed into one PES if none of them has an opaque, so every section
+ * with an opaque is reported.
+ * The callback is copied by ts_clone_writer and is not part of the saved state. Pass NULL to remove it.
+ */
+typedef struct
+{
+    int pid;
+    void *opaque;
+    int64_t first_pcr;
+    int64_t last_pcr;
+    int64_t queue_time;
+    int dropped;
+} ts_frame_done_t;
+
+typedef void (*ts_frame_done_callback_t)( void *priv, const ts_frame_done_t *done );
+
+void ts_set_frame_done_callback( ts_writer_t *w, ts_frame_done_callback_t callback, void *priv );
+
+/* Add or delete a stream without restarting the writer
+ *
+ * The PMT version is incremented and the new PMT is sent straight away. The PCR and continuity counters of the other
+ * streams carry on. A stream added on the PCR PID takes over the PCR; if the stream on the PCR PID is deleted the PCR
+ * carries on in PCR-only packets.
+ *
+ * ts_add_stream takes the same parameters as the streams of ts_setup_transport_stream. Codec specific information
+ * (e.g. ts_setup_mpegvideo_stream) must be set up before frames are written.
+ * ts_delete_stream drops any frames of the stream which have not been written.
  * */
+int ts_add_stream( ts_writer_t *w, ts_stream_t *stream );
 int ts_delete_stream( ts_writer_t *w, int pid );
 
+/* Splicing
+ *
+ * Marks a splice point in a stream, e.g. for ad insertion. The application switches to frames from the new source
+ * from splice_pts onwards and the writer signals the splice point in the adaptation fields: splice_countdown runs
+ * over the packets of the last access unit before the splice point and the first packet of the new source has a
+ * splice_countdown of -1. The splice point is in front of the first frame on the PID with a PTS of at least splice_pts.
+ * For video this must be a random access point.
+ *
+ * pid - stream to splice (not SCTE-35)
+ * splice_pts - PTS of the first access unit of the new source (in 90KHz clock ticks, same timebase as ts_frame_t)
+ * seamless - write seamless_splice_flag, splice_type and DTS_next_AU
+ * splice_type - See Tables 2-7 to 2-16 in ISO 13818-1
+ * ltw - write ltw_offset (the time until the access unit is decoded) in the packets before the splice point
+ * piecewise_rate - write piecewise_rate (the rate of the access unit) in the packets before the splice point
+ *
+ * scte35_pid - If nonzero, a SCTE-35 splice_insert() for the splice point is written on this SCTE-35 stream
+ *              with the frames of the next call of ts_write_frames or ts_write_frame_chunk.
+ *              It should be scheduled at least the pre-roll (typically 4 seconds) before splice_pts.
+ * splice_event_id - splice_event_id of the splice_insert()
+ * out_of_network - Set when splicing from the network to an insertion (e.g. an ad), clear when returning
+ * break_duration - Duration of the break in 90KHz clock ticks with auto_return set, 0 for none
+ * unique_program_id, avail_num, avails_expected - See SCTE 35
+ *
+ * The splice_countdown is at most one access unit long. If the access unit after the splice point has not
+ * been passed to the writer by the time the last access unit before it is written, only the -1 is signalled.
+ */
+typedef struct
+{
+    int pid;
+    int64_t splice_pts;
+    int seamless;
+    int splice_type;
+    int ltw;
+    int piecewise_rate;
+
+    int scte35_pid;
+    uint32_t splice_event_id;
+    int out_of_network;
+    int64_t break_duration;
+    int unique_program_id;
+    int avail_num;
+    int avails_expected;
+} ts_splice_t;
+
+int ts_schedule_splice( ts_writer_t *w, ts_splice_t *splice );
+
 
 
 int ts_close_writer( ts_writer_t *w );